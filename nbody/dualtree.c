@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include "util/xiwilib.h"
+#include "layout.h"
+#include "force.h"
+#include "quadtree.h"
+#include "threadpool.h"
+#include "forcekernel.h"
+#include "dualtree.h"
+
+// The Barnes-Hut walk in force.c opens the tree once for each leaf.  Here the
+// tree is instead walked against itself, and a pair of cells that are well
+// separated interacts as a whole: the field of the source cell (its monopole
+// and quadrupole) and the gradient of its monopole are added at the centre of
+// mass of the target cell.  A final pass pushes these down the tree, shifting
+// the field to the centre of mass of each child with the gradient, and then
+// evaluates it at the items of the leaves.  This is a first order local
+// expansion of the field, which is enough for the accuracy of Barnes-Hut and
+// far cheaper than the expansions of the FMM solver.
+//
+// Pairs of leaves that are not well separated are recorded in a near list for
+// the target leaf, whose items are then done directly by the force kernel.
+// With close repulsion a leaf is never approximated, as in the Barnes-Hut walk.
+//
+// Each interaction only writes to the target cell, so the tree is split into
+// subtrees which each interact with the whole tree, one per task.
+
+// the tree is split into subtrees at a depth which gives at least this many
+// subtrees per thread, to balance the load with work stealing
+#define DUAL_TREE_SUBTREES_PER_THREAD (16)
+
+typedef struct _dual_env_t {
+    force_params_t *param;
+    quadtree_t *qt;
+    bool (*f)(layout_node_t*);
+} dual_env_t;
+
+// per cell, indexed as the quad tree
+static int cells_alloc = 0;
+static double *extent = NULL;   // distance from the centre of mass to the furthest item
+static double *field_x = NULL;  // field at the centre of mass, per unit mass of the target
+static double *field_y = NULL;
+static double *grad_xx = NULL;  // and its gradient
+static double *grad_xy = NULL;
+static double *grad_yy = NULL;
+static int *near_head = NULL;   // for a leaf, first entry of its near list, -1 if empty
+
+// the near lists of the leaves of one task, as linked lists in a pool per thread
+typedef struct _dual_near_t {
+    int leaf;
+    int next;
+} dual_near_t;
+
+typedef struct _dual_thread_t {
+    int num_near;
+    int near_alloc;
+    dual_near_t *near;
+    force_ilist_t il;
+} dual_thread_t;
+
+static int num_dual_threads = 0;
+static dual_thread_t *dual_threads = NULL;
+
+// subtrees whose forces can be computed independently, one per task
+static int subtrees_alloc = 0;
+static int num_subtrees = 0;
+static int *subtrees = NULL;
+
+static void subtrees_add(int q) {
+    if (num_subtrees >= subtrees_alloc) {
+        subtrees_alloc = subtrees_alloc == 0 ? 256 : 2 * subtrees_alloc;
+        subtrees = m_renew(int, subtrees, subtrees_alloc);
+    }
+    subtrees[num_subtrees++] = q;
+}
+
+static void subtrees_collect(quadtree_t *qt, int q, int depth) {
+    if (depth == 0 || quadtree_is_leaf(qt, q)) {
+        subtrees_add(q);
+    } else {
+        int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+        for (int c = qt->first[q]; c < c_hi; c++) {
+            subtrees_collect(qt, c, depth - 1);
+        }
+    }
+}
+
+static void dual_near_add(dual_thread_t *th, int a, int b) {
+    if (th->num_near >= th->near_alloc) {
+        th->near_alloc = th->near_alloc == 0 ? 1024 : 2 * th->near_alloc;
+        th->near = m_renew(dual_near_t, th->near, th->near_alloc);
+    }
+    th->near[th->num_near].leaf = b;
+    th->near[th->num_near].next = near_head[a];
+    near_head[a] = th->num_near++;
+}
+
+// extents of all cells, bottom up, and clear the fields and near lists
+static void dual_tree_prepare(quadtree_t *qt) {
+    if (qt->num_cells > cells_alloc) {
+        cells_alloc = qt->num_cells;
+        extent = m_renew(double, extent, cells_alloc);
+        field_x = m_renew(double, field_x, cells_alloc);
+        field_y = m_renew(double, field_y, cells_alloc);
+        grad_xx = m_renew(double, grad_xx, cells_alloc);
+        grad_xy = m_renew(double, grad_xy, cells_alloc);
+        grad_yy = m_renew(double, grad_yy, cells_alloc);
+        near_head = m_renew(int, near_head, cells_alloc);
+    }
+
+    // children are stored after their parent
+    for (int q = qt->num_cells - 1; q >= 0; q--) {
+        double x = qt->x[q];
+        double y = qt->y[q];
+        double e = 0;
+        if (quadtree_is_leaf(qt, q)) {
+            int i_hi = qt->first[q] + qt->num_items[q];
+            for (int i = qt->first[q]; i < i_hi; i++) {
+                double dx = qt->item_x[i] - x;
+                double dy = qt->item_y[i] - y;
+                e = fmax(e, dx * dx + dy * dy);
+            }
+            e = sqrt(e);
+        } else {
+            int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+            for (int c = qt->first[q]; c < c_hi; c++) {
+                double dx = qt->x[c] - x;
+                double dy = qt->y[c] - y;
+                e = fmax(e, sqrt(dx * dx + dy * dy) + extent[c]);
+            }
+        }
+        extent[q] = e;
+        field_x[q] = 0;
+        field_y[q] = 0;
+        grad_xx[q] = 0;
+        grad_xy[q] = 0;
+        grad_yy[q] = 0;
+        near_head[q] = -1;
+    }
+}
+
+// field of source cell b, and the gradient of its monopole, at the centre of mass of target cell a
+static void dual_tree_far(force_params_t *param, quadtree_t *qt, int a, int b, double dx, double dy, double rsq) {
+    // field is mass * phi(rsq) * (dx, dy), with phi' the derivative of phi wrt rsq
+    double phi, dphi;
+    if (rsq > param->anti_gravity_falloff_rsq) {
+        phi = param->anti_gravity_falloff_rsq / (rsq * rsq);
+        dphi = -2.0 * phi / rsq;
+    } else {
+        phi = 1.0 / rsq;
+        dphi = -phi / rsq;
+        force_kernel_quadrupole(1.0, qt->q_xx[b], qt->q_xy[b], dx, dy, rsq, &field_x[a], &field_y[a]);
+    }
+    phi *= qt->mass[b];
+    dphi *= 2.0 * qt->mass[b];
+
+    field_x[a] += phi * dx;
+    field_y[a] += phi * dy;
+    grad_xx[a] += phi + dphi * dx * dx;
+    grad_xy[a] += dphi * dx * dy;
+    grad_yy[a] += phi + dphi * dy * dy;
+}
+
+// accumulates the interactions of all the items in target cell a due to all
+// the items in source cell b; only cells within a are written to
+static void dual_tree_interact(dual_env_t *env, dual_thread_t *th, int a, int b) {
+    force_params_t *param = env->param;
+    quadtree_t *qt = env->qt;
+    bool a_leaf = quadtree_is_leaf(qt, a);
+    bool b_leaf = quadtree_is_leaf(qt, b);
+
+    if (a != b && !(b_leaf && param->do_close_repulsion)) {
+        double dx = qt->x[a] - qt->x[b];
+        double dy = qt->y[a] - qt->y[b];
+        double rsq = dx * dx + dy * dy;
+        // the same criterion as Barnes-Hut, with the extents of both cells for the side length
+        double size = 2.0 * (extent[a] + extent[b]);
+        if (size * size < param->barnes_hut_opening * rsq) {
+            dual_tree_far(param, qt, a, b, dx, dy, rsq);
+            return;
+        }
+    }
+
+    if (a_leaf && b_leaf) {
+        // the items of the leaf a itself are done when evaluating it
+        if (a != b) {
+            dual_near_add(th, a, b);
+        }
+        return;
+    }
+
+    // not well separated, split the larger cell (a leaf is never split)
+    if (b_leaf || (!a_leaf && extent[a] >= extent[b])) {
+        int c_hi = qt->first[a] + quadtree_num_children(qt, a);
+        for (int c = qt->first[a]; c < c_hi; c++) {
+            dual_tree_interact(env, th, c, b);
+        }
+    } else {
+        int c_hi = qt->first[b] + quadtree_num_children(qt, b);
+        for (int c = qt->first[b]; c < c_hi; c++) {
+            dual_tree_interact(env, th, a, c);
+        }
+    }
+}
+
+// adds the forces on the items of leaf q, from its near list, its own items and its field
+static void dual_tree_leaf(dual_env_t *env, dual_thread_t *th, int q) {
+    force_params_t *param = env->param;
+    quadtree_t *qt = env->qt;
+    force_ilist_t *il = &th->il;
+
+    force_ilist_reset(il);
+    for (int k = near_head[q]; k >= 0; k = th->near[k].next) {
+        int b = th->near[k].leaf;
+        int j_hi = qt->first[b] + qt->num_items[b];
+        for (int j = qt->first[b]; j < j_hi; j++) {
+            if (param->do_close_repulsion) {
+                force_ilist_add_leaf(il, qt->item_x[j], qt->item_y[j], qt->item_mass[j], qt->item_radius[j]);
+            } else {
+                force_ilist_add_cell(il, qt->item_x[j], qt->item_y[j], qt->item_mass[j], 0, 0);
+            }
+        }
+    }
+
+    int i_lo = qt->first[q];
+    int i_hi = i_lo + qt->num_items[q];
+    for (int i = i_lo; i < i_hi; i++) {
+        layout_node_t *ln = quadtree_get_item(qt, i);
+        if (env->f != NULL && !env->f(ln)) {
+            continue;
+        }
+        double x = qt->item_x[i];
+        double y = qt->item_y[i];
+        double fx, fy;
+        force_kernel_eval(param, il, x, y, qt->item_mass[i], qt->item_radius[i], &fx, &fy);
+
+        // the other items of this leaf
+        for (int j = i_lo; j < i_hi; j++) {
+            if (j == i) {
+                continue;
+            }
+            double dx = x - qt->item_x[j];
+            double dy = y - qt->item_y[j];
+            double rsq = dx * dx + dy * dy;
+            if (rsq < 1e-6) {
+                // minimum distance cut-off
+                rsq = 1e-6;
+            }
+            double m1m2 = qt->item_mass[i] * qt->item_mass[j];
+            double fac;
+            if (param->do_close_repulsion) {
+                fac = force_kernel_close_repulsion_fac(param, m1m2, qt->item_radius[i], qt->item_radius[j], rsq);
+            } else {
+                fac = force_kernel_anti_gravity_fac(param, m1m2, rsq);
+            }
+            fx += dx * fac;
+            fy += dy * fac;
+        }
+
+        // the field of the well-separated cells
+        double ex = x - qt->x[q];
+        double ey = y - qt->y[q];
+        fx += qt->item_mass[i] * (field_x[q] + grad_xx[q] * ex + grad_xy[q] * ey);
+        fy += qt->item_mass[i] * (field_y[q] + grad_xy[q] * ex + grad_yy[q] * ey);
+
+        ln->fx += fx;
+        ln->fy += fy;
+    }
+}
+
+// pushes the field of cell q down to its leaves, and evaluates them
+static void dual_tree_downward(dual_env_t *env, dual_thread_t *th, int q) {
+    quadtree_t *qt = env->qt;
+    if (quadtree_is_leaf(qt, q)) {
+        dual_tree_leaf(env, th, q);
+        return;
+    }
+    int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+    for (int c = qt->first[q]; c < c_hi; c++) {
+        double ex = qt->x[c] - qt->x[q];
+        double ey = qt->y[c] - qt->y[q];
+        field_x[c] += field_x[q] + grad_xx[q] * ex + grad_xy[q] * ey;
+        field_y[c] += field_y[q] + grad_xy[q] * ex + grad_yy[q] * ey;
+        grad_xx[c] += grad_xx[q];
+        grad_xy[c] += grad_xy[q];
+        grad_yy[c] += grad_yy[q];
+        dual_tree_downward(env, th, c);
+    }
+}
+
+static void dual_tree_task(void *env_in, int task, int thread) {
+    dual_env_t *env = env_in;
+    dual_thread_t *th = &dual_threads[thread];
+    th->num_near = 0;
+    dual_tree_interact(env, th, subtrees[task], QUADTREE_ROOT);
+    dual_tree_downward(env, th, subtrees[task]);
+}
+
+// computes the anti-gravity (and close repulsion) forces and adds them to the
+// items for which f is true, or to all items if f is NULL
+static void dual_tree_compute(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*)) {
+    if (qt->num_cells == 0) {
+        return;
+    }
+
+    int num_threads = threadpool_get_num_threads();
+    if (num_dual_threads < num_threads) {
+        dual_threads = m_renew(dual_thread_t, dual_threads, num_threads);
+        for (int i = num_dual_threads; i < num_threads; i++) {
+            dual_threads[i].num_near = 0;
+            dual_threads[i].near_alloc = 0;
+            dual_threads[i].near = NULL;
+            force_ilist_init(&dual_threads[i].il);
+        }
+        num_dual_threads = num_threads;
+    }
+
+    dual_tree_prepare(qt);
+
+    dual_env_t env = {param, qt, f};
+    if (num_threads == 1 || quadtree_is_leaf(qt, QUADTREE_ROOT)) {
+        // without threading
+        num_subtrees = 0;
+        subtrees_add(QUADTREE_ROOT);
+        dual_tree_task(&env, 0, 0);
+    } else {
+        // with threading
+        int depth = 1;
+        while ((1 << (2 * depth)) < DUAL_TREE_SUBTREES_PER_THREAD * num_threads) {
+            depth += 1;
+        }
+        num_subtrees = 0;
+        subtrees_collect(qt, QUADTREE_ROOT, depth);
+        threadpool_run(num_subtrees, dual_tree_task, &env);
+    }
+}
+
+void dual_tree_forces(force_params_t *param, quadtree_t *qt) {
+    dual_tree_compute(param, qt, NULL);
+}
+
+// the forces for all items are computed, but only applied to those for which f is true
+void dual_tree_forces_apply_if(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*)) {
+    dual_tree_compute(param, qt, f);
+}
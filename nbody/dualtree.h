@@ -0,0 +1,13 @@
+#ifndef _INCLUDED_DUALTREE_H
+#define _INCLUDED_DUALTREE_H
+
+#include "force.h"
+
+// dual-tree solver for the anti-gravity force, where pairs of well-separated
+// cells of the quad tree interact as a whole, an alternative to the
+// Barnes-Hut walk in force.c using the same quad tree and opening parameter
+
+void dual_tree_forces(force_params_t *param, quadtree_t *qt);
+void dual_tree_forces_apply_if(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*));
+
+#endif // _INCLUDED_DUALTREE_H
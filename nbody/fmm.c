@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <complex.h>
+
+#include "util/xiwilib.h"
+#include "layout.h"
+#include "force.h"
+#include "quadtree.h"
+#include "threadpool.h"
+#include "forcekernel.h"
+#include "fmm.h"
+
+// In 2D the anti-gravity force on a node of mass m at z due to a node of
+// mass m_j at z_j is
+//     F = m m_j (z - z_j) / |z - z_j|^2 = m conj(m_j / (z - z_j))
+// so the force field of a group of nodes is the conjugate of the analytic
+// function f(z) = sum_j m_j / (z - z_j).  This is expanded about the centres
+// of the quad tree cells using
+//     multipole: f(z) = sum_k M_k / (z - z_M)^(k+1),   M_k = sum_j m_j (z_j - z_M)^k
+//     local:     f(z) = sum_n L_n (z - z_L)^n
+//
+// Beyond the falloff distance the force is no longer harmonic, so interactions
+// that reach past it use the monopole of the source cell (at its centre of
+// mass) and a first order Taylor expansion of the field about the target cell.
+//
+// Interactions between leaves are done directly, with close repulsion, and
+// cells are only approximated when none of their items can be close enough to
+// each other for close repulsion.  A leaf with a single item is expanded about
+// that item, and one with several about its geometric centre.
+
+// cells are well separated if (side_1 + side_2) < theta * distance; the
+// monopole approximation needs a stricter theta than the multipole expansion
+#define FMM_THETA         (1.0)
+#define FMM_THETA_FALLOFF (0.3)
+
+// the tree is split into subtrees at a depth which gives at least this many
+// subtrees per thread, to balance the load with work stealing
+#define FMM_SUBTREES_PER_THREAD (16)
+#define FMM_MIN_SPLIT_DEPTH (4)
+
+typedef struct _fmm_cell_t {
+    double complex centre;  // expansion centre; geometric centre of the cell, or the item for a leaf with one item
+    double side;            // side length of the square about the centre covering the items, 0 for a leaf with one item
+    double mass;
+    double com_x;           // centre of mass
+    double com_y;
+    int child[4];           // index of each child cell, or -1 if empty
+    int first_item;         // position of the first item of a leaf in the quad tree's order
+    int num_items;          // non-zero for a leaf
+    double radius;          // largest radius of an item in the cell
+    double far_x;           // field beyond the falloff distance at the centre
+    double far_y;
+    double far_xx;          // and its gradient
+    double far_xy;
+    double far_yy;
+} fmm_cell_t;
+
+typedef struct _fmm_env_t {
+    force_params_t *param;
+    quadtree_t *qt;
+    bool (*f)(layout_node_t*);
+    int order;
+} fmm_env_t;
+
+static int cells_alloc = 0;
+static int num_cells = 0;
+static fmm_cell_t *cells = NULL;
+static double complex *mpoles = NULL;   // order + 1 coefficients per cell
+static double complex *locals = NULL;   // order + 1 coefficients per cell
+static int items_alloc = 0;
+static double *near_fx = NULL;          // force on each item from direct interactions
+static double *near_fy = NULL;
+
+// subtrees whose expansions can be computed independently, one per task,
+// and the cells above them, in pre-order
+static int subtrees_alloc = 0;
+static int num_subtrees = 0;
+static int *subtrees = NULL;
+static int top_cells_alloc = 0;
+static int num_top_cells = 0;
+static int *top_cells = NULL;
+
+static bool binomials_done = false;
+static double binomials[2 * FMM_MAX_ORDER + 2][2 * FMM_MAX_ORDER + 2];
+
+static void binomials_init(void) {
+    if (!binomials_done) {
+        for (int n = 0; n < 2 * FMM_MAX_ORDER + 2; n++) {
+            binomials[n][0] = 1;
+            for (int k = 1; k <= n; k++) {
+                binomials[n][k] = binomials[n - 1][k - 1] + (k < n ? binomials[n - 1][k] : 0);
+            }
+        }
+        binomials_done = true;
+    }
+}
+
+static void subtrees_add(int c) {
+    if (num_subtrees >= subtrees_alloc) {
+        subtrees_alloc = subtrees_alloc == 0 ? 256 : 2 * subtrees_alloc;
+        subtrees = m_renew(int, subtrees, subtrees_alloc);
+    }
+    subtrees[num_subtrees++] = c;
+}
+
+static void top_cells_add(int c) {
+    if (num_top_cells >= top_cells_alloc) {
+        top_cells_alloc = top_cells_alloc == 0 ? 256 : 2 * top_cells_alloc;
+        top_cells = m_renew(int, top_cells, top_cells_alloc);
+    }
+    top_cells[num_top_cells++] = c;
+}
+
+// make a cell (and all cells below it) for the quad tree cell q, in pre-order
+static int fmm_mirror(quadtree_t *qt, int q, double min_x, double min_y, double side, int depth, int split_depth) {
+    int c = num_cells++;
+    fmm_cell_t *cell = &cells[c];
+    cell->mass = qt->mass[q];
+    cell->com_x = qt->x[q];
+    cell->com_y = qt->y[q];
+    cell->far_x = 0;
+    cell->far_y = 0;
+    cell->far_xx = 0;
+    cell->far_xy = 0;
+    cell->far_yy = 0;
+
+    double h = 0.5 * side;
+    if (quadtree_is_leaf(qt, q)) {
+        if (qt->num_items[q] == 1) {
+            // a leaf with one item is expanded about it, so its multipole is exact
+            cell->centre = qt->x[q] + I * qt->y[q];
+            cell->side = 0;
+        } else {
+            cell->centre = (min_x + h) + I * (min_y + h);
+            cell->side = qt->side_length[q];
+        }
+        cell->child[0] = cell->child[1] = cell->child[2] = cell->child[3] = -1;
+        cell->first_item = qt->first[q];
+        cell->num_items = qt->num_items[q];
+        cell->radius = qt->radius[q];
+        for (int i = cell->first_item; i < cell->first_item + cell->num_items; i++) {
+            near_fx[i] = 0;
+            near_fy[i] = 0;
+        }
+        if (depth <= split_depth) {
+            subtrees_add(c);
+        }
+    } else {
+        cell->centre = (min_x + h) + I * (min_y + h);
+        cell->side = qt->side_length[q];
+        cell->num_items = 0;
+        cell->radius = 0; // computed by the upward pass
+        if (depth == split_depth) {
+            subtrees_add(c);
+        } else if (depth < split_depth) {
+            top_cells_add(c);
+        }
+        // cell pointer is still valid, the cells array is allocated up front
+        int child = qt->first[q];
+        for (int i = 0; i < 4; i++) {
+            if (qt->child_mask[q] & (1 << i)) {
+                cell->child[i] = fmm_mirror(qt, child++, min_x + (i & 1) * h, min_y + (i >> 1) * h, h, depth + 1, split_depth);
+            } else {
+                cell->child[i] = -1;
+            }
+        }
+    }
+    return c;
+}
+
+/******************************************************************************/
+// expansion operators
+
+// shift the multipole of child cell c to its parent p and add it
+static void fmm_m2m(int order, int c, int p) {
+    const double complex *Mc = &mpoles[c * (order + 1)];
+    double complex *Mp = &mpoles[p * (order + 1)];
+    double complex d = cells[c].centre - cells[p].centre;
+    double complex dpow[FMM_MAX_ORDER + 1];
+    dpow[0] = 1;
+    for (int k = 1; k <= order; k++) {
+        dpow[k] = dpow[k - 1] * d;
+    }
+    for (int k = 0; k <= order; k++) {
+        double complex sum = 0;
+        for (int l = 0; l <= k; l++) {
+            sum += binomials[k][l] * Mc[l] * dpow[k - l];
+        }
+        Mp[k] += sum;
+    }
+}
+
+// convert the multipole of source cell b to a local expansion about target cell a and add it
+static void fmm_m2l(int order, int a, int b) {
+    const double complex *M = &mpoles[b * (order + 1)];
+    double complex *L = &locals[a * (order + 1)];
+    double complex d = cells[a].centre - cells[b].centre;
+    double complex inv = conj(d) / (creal(d) * creal(d) + cimag(d) * cimag(d));
+
+    if (cells[a].side == 0) {
+        // target is a leaf with one item at its centre, so only L_0 is needed
+        double complex sum = 0;
+        double complex ipow = inv;
+        for (int k = 0; k <= order; k++) {
+            sum += M[k] * ipow;
+            ipow *= inv;
+        }
+        L[0] += sum;
+        return;
+    }
+
+    double complex ipow[2 * FMM_MAX_ORDER + 2];
+    ipow[0] = 1;
+    for (int j = 1; j <= 2 * order + 1; j++) {
+        ipow[j] = ipow[j - 1] * inv;
+    }
+
+    if (cells[b].side == 0) {
+        // source is a leaf with one item at its centre, which only has a monopole
+        for (int n = 0; n <= order; n++) {
+            double complex t = M[0] * ipow[n + 1];
+            L[n] += (n & 1) ? -t : t;
+        }
+        return;
+    }
+
+    for (int n = 0; n <= order; n++) {
+        double complex sum = 0;
+        for (int k = 0; k <= order; k++) {
+            sum += binomials[n + k][k] * M[k] * ipow[n + k + 1];
+        }
+        L[n] += (n & 1) ? -sum : sum;
+    }
+}
+
+// shift the local expansion of parent cell p to its child c and add it
+static void fmm_l2l(int order, int p, int c) {
+    const double complex *Lp = &locals[p * (order + 1)];
+    double complex *Lc = &locals[c * (order + 1)];
+    double complex e = cells[c].centre - cells[p].centre;
+    double complex epow[FMM_MAX_ORDER + 1];
+    epow[0] = 1;
+    for (int n = 1; n <= order; n++) {
+        epow[n] = epow[n - 1] * e;
+    }
+    // a leaf with one item at its centre only needs L_0
+    int m_max = cells[c].side == 0 ? 0 : order;
+    for (int m = 0; m <= m_max; m++) {
+        double complex sum = 0;
+        for (int n = m; n <= order; n++) {
+            sum += binomials[n][m] * Lp[n] * epow[n - m];
+        }
+        Lc[m] += sum;
+    }
+}
+
+// field of the monopole of source cell b, and its gradient, at the centre of target cell a
+static void fmm_far_monopole(force_params_t *param, int a, int b) {
+    fmm_cell_t *ca = &cells[a];
+    fmm_cell_t *cb = &cells[b];
+    double dx = creal(ca->centre) - cb->com_x;
+    double dy = cimag(ca->centre) - cb->com_y;
+    double rsq = dx * dx + dy * dy;
+
+    // field is mass * phi(rsq) * (dx, dy), with phi' the derivative of phi wrt rsq
+    double phi, dphi;
+    if (rsq > param->anti_gravity_falloff_rsq) {
+        phi = param->anti_gravity_falloff_rsq / (rsq * rsq);
+        dphi = -2.0 * phi / rsq;
+    } else {
+        phi = 1.0 / rsq;
+        dphi = -phi / rsq;
+    }
+    phi *= cb->mass;
+    dphi *= 2.0 * cb->mass;
+
+    ca->far_x += phi * dx;
+    ca->far_y += phi * dy;
+    ca->far_xx += phi + dphi * dx * dx;
+    ca->far_xy += dphi * dx * dy;
+    ca->far_yy += phi + dphi * dy * dy;
+}
+
+// direct forces on the items of leaf a due to the items of leaf b
+static void fmm_p2p(fmm_env_t *env, int a, int b) {
+    force_params_t *param = env->param;
+    quadtree_t *qt = env->qt;
+    fmm_cell_t *ca = &cells[a];
+    fmm_cell_t *cb = &cells[b];
+    int j_lo = cb->first_item;
+    int j_hi = cb->first_item + cb->num_items;
+    for (int i = ca->first_item; i < ca->first_item + ca->num_items; i++) {
+        double x = qt->item_x[i];
+        double y = qt->item_y[i];
+        double fx = 0;
+        double fy = 0;
+        for (int j = j_lo; j < j_hi; j++) {
+            if (j == i) {
+                continue;
+            }
+            double dx = x - qt->item_x[j];
+            double dy = y - qt->item_y[j];
+            double rsq = dx * dx + dy * dy;
+            if (rsq < 1e-6) {
+                // minimum distance cut-off
+                rsq = 1e-6;
+            }
+            double m1m2 = qt->item_mass[i] * qt->item_mass[j];
+            double fac;
+            if (param->do_close_repulsion) {
+                fac = force_kernel_close_repulsion_fac(param, m1m2, qt->item_radius[i], qt->item_radius[j], rsq);
+            } else {
+                fac = force_kernel_anti_gravity_fac(param, m1m2, rsq);
+            }
+            fx += dx * fac;
+            fy += dy * fac;
+        }
+        near_fx[i] += fx;
+        near_fy[i] += fy;
+    }
+}
+
+/******************************************************************************/
+// tree passes
+
+static void fmm_upward(fmm_env_t *env, int c) {
+    int order = env->order;
+    fmm_cell_t *cell = &cells[c];
+    double complex *M = &mpoles[c * (order + 1)];
+    for (int k = 0; k <= order; k++) {
+        M[k] = 0;
+    }
+    if (cell->num_items > 0) {
+        // a leaf, from its items
+        quadtree_t *qt = env->qt;
+        for (int i = cell->first_item; i < cell->first_item + cell->num_items; i++) {
+            double complex d = (qt->item_x[i] + I * qt->item_y[i]) - cell->centre;
+            double complex t = qt->item_mass[i];
+            for (int k = 0; k <= order; k++) {
+                M[k] += t;
+                t *= d;
+            }
+        }
+    } else {
+        for (int i = 0; i < 4; i++) {
+            if (cell->child[i] >= 0) {
+                fmm_upward(env, cell->child[i]);
+                fmm_m2m(order, cell->child[i], c);
+                cell->radius = fmax(cell->radius, cells[cell->child[i]].radius);
+            }
+        }
+    }
+}
+
+// accumulates the interactions of all the items in target cell a due to all
+// the items in source cell b; only cells within a are written to
+static void fmm_interact(fmm_env_t *env, int a, int b) {
+    fmm_cell_t *ca = &cells[a];
+    fmm_cell_t *cb = &cells[b];
+
+    if (ca->side == 0 && cb->side == 0) {
+        // both leaves with one item
+        if (a != b) {
+            fmm_p2p(env, a, b);
+        }
+        return;
+    }
+
+    if (a != b) {
+        double complex d = ca->centre - cb->centre;
+        double rsq = creal(d) * creal(d) + cimag(d) * cimag(d);
+        double side_sum = ca->side + cb->side;
+        double r = sqrt(rsq);
+        if (env->param->do_close_repulsion
+            && r - M_SQRT1_2 * side_sum < sqrt(env->param->close_repulsion_c) * (env->param->close_repulsion_d + ca->radius + cb->radius)) {
+            // items in the cells may be close enough to repel, so they must be done directly
+        } else if (side_sum * side_sum < FMM_THETA * FMM_THETA * rsq) {
+            // well separated; check if the cells are entirely within the falloff distance
+            double r_max = r + M_SQRT1_2 * side_sum;
+            if (r_max * r_max < env->param->anti_gravity_falloff_rsq) {
+                fmm_m2l(env->order, a, b);
+                return;
+            } else if (side_sum * side_sum < FMM_THETA_FALLOFF * FMM_THETA_FALLOFF * rsq) {
+                fmm_far_monopole(env->param, a, b);
+                return;
+            }
+        }
+    }
+
+    if (ca->num_items > 0 && cb->num_items > 0) {
+        // both leaves
+        fmm_p2p(env, a, b);
+        return;
+    }
+
+    // not well separated, split the larger cell (a leaf is never split)
+    if (cb->num_items > 0 || (ca->num_items == 0 && ca->side >= cb->side)) {
+        for (int i = 0; i < 4; i++) {
+            if (cells[a].child[i] >= 0) {
+                fmm_interact(env, cells[a].child[i], b);
+            }
+        }
+    } else {
+        for (int i = 0; i < 4; i++) {
+            if (cells[b].child[i] >= 0) {
+                fmm_interact(env, a, cells[b].child[i]);
+            }
+        }
+    }
+}
+
+static void fmm_downward(fmm_env_t *env, int c) {
+    fmm_cell_t *cell = &cells[c];
+    const double complex *L = &locals[c * (env->order + 1)];
+
+    if (cell->num_items > 0) {
+        // evaluate the local expansion and far field at each item of the leaf
+        quadtree_t *qt = env->qt;
+        for (int i = cell->first_item; i < cell->first_item + cell->num_items; i++) {
+            layout_node_t *item = quadtree_get_item(qt, i);
+            if (env->f == NULL || env->f(item)) {
+                double ex = qt->item_x[i] - creal(cell->centre);
+                double ey = qt->item_y[i] - cimag(cell->centre);
+                double complex e = ex + I * ey;
+                double complex field = 0;
+                for (int n = env->order; n >= 0; n--) {
+                    field = field * e + L[n];
+                }
+                double far_x = cell->far_x + cell->far_xx * ex + cell->far_xy * ey;
+                double far_y = cell->far_y + cell->far_xy * ex + cell->far_yy * ey;
+                item->fx += near_fx[i] + qt->item_mass[i] * (creal(field) + far_x);
+                item->fy += near_fy[i] + qt->item_mass[i] * (-cimag(field) + far_y);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        int c2 = cell->child[i];
+        if (c2 >= 0) {
+            fmm_cell_t *child = &cells[c2];
+            double ex = creal(child->centre) - creal(cell->centre);
+            double ey = cimag(child->centre) - cimag(cell->centre);
+            fmm_l2l(env->order, c, c2);
+            child->far_x += cell->far_x + cell->far_xx * ex + cell->far_xy * ey;
+            child->far_y += cell->far_y + cell->far_xy * ex + cell->far_yy * ey;
+            child->far_xx += cell->far_xx;
+            child->far_xy += cell->far_xy;
+            child->far_yy += cell->far_yy;
+            fmm_downward(env, c2);
+        }
+    }
+}
+
+static void fmm_upward_task(void *env_in, int task, int thread) {
+    fmm_env_t *env = env_in;
+    fmm_upward(env, subtrees[task]);
+}
+
+static void fmm_interact_task(void *env_in, int task, int thread) {
+    fmm_env_t *env = env_in;
+    fmm_interact(env, subtrees[task], 0);
+    fmm_downward(env, subtrees[task]);
+}
+
+// computes the anti-gravity (and close repulsion) forces and adds them to the
+// items for which f is true, or to all items if f is NULL
+static void fmm_compute(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*)) {
+    if (qt->num_cells == 0) {
+        return;
+    }
+
+    binomials_init();
+    fmm_env_t env = {param, qt, f, param->fmm_order};
+    if (env.order < 1) {
+        env.order = 1;
+    } else if (env.order > FMM_MAX_ORDER) {
+        env.order = FMM_MAX_ORDER;
+    }
+
+    // allocate one cell per quad tree cell
+    if (qt->num_cells > cells_alloc) {
+        cells_alloc = qt->num_cells;
+        cells = m_renew(fmm_cell_t, cells, cells_alloc);
+        mpoles = m_renew(double complex, mpoles, cells_alloc * (FMM_MAX_ORDER + 1));
+        locals = m_renew(double complex, locals, cells_alloc * (FMM_MAX_ORDER + 1));
+    }
+    if (qt->num_items[QUADTREE_ROOT] > items_alloc) {
+        items_alloc = qt->num_items[QUADTREE_ROOT];
+        near_fx = m_renew(double, near_fx, items_alloc);
+        near_fy = m_renew(double, near_fy, items_alloc);
+    }
+
+    // work out at which depth to split the tree into tasks; the order of the
+    // interactions depends on this depth, so it has a minimum to make the
+    // result independent of the number of threads (for a reasonable number)
+    int num_threads = threadpool_get_num_threads();
+    int split_depth = FMM_MIN_SPLIT_DEPTH;
+    while ((1 << (2 * split_depth)) < FMM_SUBTREES_PER_THREAD * num_threads) {
+        split_depth += 1;
+    }
+
+    // mirror the quad tree, with geometric centres for the cells
+    num_cells = 0;
+    num_subtrees = 0;
+    num_top_cells = 0;
+    fmm_mirror(qt, QUADTREE_ROOT, qt->min_x, qt->min_y, qt->max_x - qt->min_x, 0, split_depth);
+    assert(num_cells <= cells_alloc);
+    memset(locals, 0, num_cells * (env.order + 1) * sizeof(double complex));
+
+    // upward pass: multipoles of the subtrees, then of the cells above them
+    threadpool_run(num_subtrees, fmm_upward_task, &env);
+    for (int i = num_top_cells - 1; i >= 0; i--) {
+        int c = top_cells[i];
+        memset(&mpoles[c * (env.order + 1)], 0, (env.order + 1) * sizeof(double complex));
+        for (int j = 0; j < 4; j++) {
+            if (cells[c].child[j] >= 0) {
+                fmm_m2m(env.order, cells[c].child[j], c);
+                cells[c].radius = fmax(cells[c].radius, cells[cells[c].child[j]].radius);
+            }
+        }
+    }
+
+    // each subtree interacts with the whole tree, then passes its local expansion down
+    threadpool_run(num_subtrees, fmm_interact_task, &env);
+}
+
+void fmm_forces(force_params_t *param, quadtree_t *qt) {
+    fmm_compute(param, qt, NULL);
+}
+
+// the forces for all items are computed, but only applied to those for which f is true
+void fmm_forces_apply_if(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*)) {
+    fmm_compute(param, qt, f);
+}
@@ -0,0 +1,14 @@
+#ifndef _INCLUDED_FMM_H
+#define _INCLUDED_FMM_H
+
+#include "force.h"
+
+// Fast Multipole Method solver for the anti-gravity force, an order N
+// alternative to the Barnes-Hut walk in force.c, using the same quad tree
+
+#define FMM_MAX_ORDER (20)
+
+void fmm_forces(force_params_t *param, quadtree_t *qt);
+void fmm_forces_apply_if(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*));
+
+#endif // _INCLUDED_FMM_H
@@ -1,4 +1,6 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 
@@ -7,47 +9,162 @@
 #include "layout.h"
 #include "force.h"
 #include "quadtree.h"
+#include "threadpool.h"
+#include "forcekernel.h"
 
-void force_compute_attractive_link_force(force_params_t *param, bool do_tred, layout_t *layout) {
-    for (int i = 0; i < layout->num_nodes; i++) {
+// the quad tree is split into subtrees at a depth which gives at least this
+// many subtrees per thread, to balance the load with work stealing
+#define FORCE_SUBTREES_PER_THREAD (16)
+
+// link forces are computed for chunks of nodes, this many per thread
+#define FORCE_LINK_CHUNKS_PER_THREAD (16)
+
+// a cached interaction list is recorded again after it has been used this many
+// times, or once the centre of mass of its group has moved more than this
+// fraction of the side length of the group
+#define FORCE_ILIST_CACHE_MAX_AGE (10)
+#define FORCE_ILIST_CACHE_MAX_DRIFT (0.1)
+
+// the spring constant of a link with the given weight
+static double force_link_stiffness(force_params_t *param, double weight) {
+    double fac = param->link_strength;
+
+    if (param->use_ref_freq) {
+        fac *= 0.65 * weight;
+    }
+
+    /*
+    // these things we can only do if the nodes are papers
+    if (layout->child_layout == NULL) {
+        if (do_tred) {
+            //fac *= n1->paper->refs_tred_computed[j];
+        }
+
+        // loosen the force between papers in different categories
+        if (n1->paper->kind != n2->paper->kind) {
+            fac *= 0.5;
+        }
+
+        // loosen the force between papers of different age
+        fac *= 1.01 - 0.5 * fabs(n1->paper->age - n2->paper->age); // trying out the 0.5* factor; not tested yet
+    }
+    */
+
+    // normalise refs so each paper has 1 unit for all references (doesn't really produce a good graph)
+    //fac /= n1->num_links;
+
+    return fac;
+}
+
+// (re)build the flat arrays of links in both directions, if they are out of date
+static void force_links_prepare(force_params_t *param, layout_t *layout) {
+    layout_edges_t *edges = &layout->edges;
+    if (edges->valid && edges->link_strength == param->link_strength && edges->use_ref_freq == param->use_ref_freq) {
+        return;
+    }
+    int n = layout->num_nodes;
+    edges->start = m_renew(int, edges->start, n + 1);
+    edges->node = m_renew(int, edges->node, 2 * layout->num_links);
+    edges->stiffness = m_renew(float, edges->stiffness, 2 * layout->num_links);
+    edges->rest_len = m_renew(float, edges->rest_len, 2 * layout->num_links);
+
+    // count the links of each node, then turn the counts into positions
+    for (int i = 0; i <= n; i++) {
+        edges->start[i] = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        layout_node_t *n1 = &layout->nodes[i];
+        edges->start[i + 1] += n1->num_links;
+        for (int j = 0; j < n1->num_links; j++) {
+            edges->start[LAYOUT_LINK_GET_NODE(&n1->links[j]) - layout->nodes + 1] += 1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        edges->start[i + 1] += edges->start[i];
+    }
+
+    // fill in the links from each node, then the links into each node, using
+    // start[i] as the next free position for node i
+    for (int i = 0; i < n; i++) {
+        layout_node_t *n1 = &layout->nodes[i];
+        for (int j = 0; j < n1->num_links; j++) {
+            layout_node_t *n2 = LAYOUT_LINK_GET_NODE(&n1->links[j]);
+            int k = edges->start[i]++;
+            edges->node[k] = n2 - layout->nodes;
+            edges->stiffness[k] = force_link_stiffness(param, LAYOUT_LINK_GET_WEIGHT(&n1->links[j]));
+            edges->rest_len[k] = 1.5 * (n1->radius + n2->radius);
+        }
+    }
+    for (int i = 0; i < n; i++) {
         layout_node_t *n1 = &layout->nodes[i];
         for (int j = 0; j < n1->num_links; j++) {
             layout_node_t *n2 = LAYOUT_LINK_GET_NODE(&n1->links[j]);
-            double weight = LAYOUT_LINK_GET_WEIGHT(&n1->links[j]);
+            int k = edges->start[n2 - layout->nodes]++;
+            edges->node[k] = i;
+            edges->stiffness[k] = force_link_stiffness(param, LAYOUT_LINK_GET_WEIGHT(&n1->links[j]));
+            edges->rest_len[k] = 1.5 * (n1->radius + n2->radius);
+        }
+    }
+    for (int i = n; i > 0; i--) {
+        edges->start[i] = edges->start[i - 1];
+    }
+    edges->start[0] = 0;
 
-            double dx = n1->x - n2->x;
-            double dy = n1->y - n2->y;
-            double r = sqrt(dx*dx + dy*dy);
-            double rest_len = 1.5 * (n1->radius + n2->radius);
+    edges->valid = true;
+    edges->link_strength = param->link_strength;
+    edges->use_ref_freq = param->use_ref_freq;
+}
 
-            double fac = param->link_strength;
+typedef struct _force_link_env_t {
+    layout_t *layout;
+    int num_chunks;
+} force_link_env_t;
+
+static void force_link_task(void *env_in, int chunk, int thread) {
+    force_link_env_t *env = env_in;
+    layout_t *layout = env->layout;
+    int lo = (int64_t)layout->num_nodes * chunk / env->num_chunks;
+    int hi = (int64_t)layout->num_nodes * (chunk + 1) / env->num_chunks;
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n1 = &layout->nodes[i];
+        float fx, fy;
+        force_kernel_links(layout, layout->edges.start[i], layout->edges.start[i + 1], n1->x, n1->y, &fx, &fy);
+        n1->fx += fx;
+        n1->fy += fy;
+    }
+}
 
-            if (param->use_ref_freq) {
-                fac *= 0.65 * weight;
-            }
+static force_link_env_t force_link_env;
 
-            /*
-            // these things we can only do if the nodes are papers
-            if (layout->child_layout == NULL) {
-                if (do_tred) {
-                    //fac *= n1->paper->refs_tred_computed[j];
-                }
+void force_queue_attractive_link_force(force_params_t *param, bool do_tred, layout_t *layout) {
+    force_links_prepare(param, layout);
 
-                // loosen the force between papers in different categories
-                if (n1->paper->kind != n2->paper->kind) {
-                    fac *= 0.5;
-                }
+    int num_threads = threadpool_get_num_threads();
+    if (num_threads > 1) {
+        // each node sums the forces of all its links, so the result does not
+        // depend on which thread does which node
+        force_link_env.layout = layout;
+        force_link_env.num_chunks = FORCE_LINK_CHUNKS_PER_THREAD * num_threads;
+        threadpool_queue(force_link_env.num_chunks, force_link_task, &force_link_env);
+        return;
+    }
 
-                // loosen the force between papers of different age
-                fac *= 1.01 - 0.5 * fabs(n1->paper->age - n2->paper->age); // trying out the 0.5* factor; not tested yet
-            }
-            */
+    // without threading, do each link once, from the node it is from
+    const int *node = layout->edges.node;
+    const float *stiffness = layout->edges.stiffness;
+    const float *rest_len = layout->edges.rest_len;
+    for (int i = 0; i < layout->num_nodes; i++) {
+        layout_node_t *n1 = &layout->nodes[i];
+        int k_hi = layout->edges.start[i] + n1->num_links;
+        for (int k = layout->edges.start[i]; k < k_hi; k++) {
+            layout_node_t *n2 = &layout->nodes[node[k]];
 
-            // normalise refs so each paper has 1 unit for all references (doesn't really produce a good graph)
-            //fac /= n1->num_links;
+            double dx = n1->x - n2->x;
+            double dy = n1->y - n2->y;
+            double r = sqrt(dx*dx + dy*dy);
 
             if (r > 1e-2) {
-                fac *= (r - rest_len) / r;
+                double fac = stiffness[k] * (r - rest_len[k]) / r;
                 double fx = dx * fac;
                 double fy = dy * fac;
 
@@ -60,217 +177,617 @@ void force_compute_attractive_link_force(force_params_t *param, bool do_tred, la
     }
 }
 
-// q1 is a leaf against which we check q2
-static void quad_tree_forces_leaf_vs_node(force_params_t *param, quadtree_node_t *q1, quadtree_node_t *q2) {
-    if (q2 == NULL) {
-        // q2 is empty node
-    } else {
-        // q2 is leaf or internal node
-
-        // compute distance from q1 to centroid of q2
-        double dx = q1->x - q2->x;
-        double dy = q1->y - q2->y;
-        double rsq = dx * dx + dy * dy;
-        if (rsq < 1e-6) {
-            // minimum distance cut-off
-            rsq = 1e-6;
+void force_compute_attractive_link_force(force_params_t *param, bool do_tred, layout_t *layout) {
+    force_queue_attractive_link_force(param, do_tred, layout);
+    threadpool_run_queued();
+}
+
+// evaluates the interactions collected in il on the item at position i
+static void quad_tree_forces_eval_item(force_params_t *param, force_ilist_t *il, quadtree_t *qt, int i) {
+    double fx, fy;
+    force_kernel_eval(param, il, qt->item_x[i], qt->item_y[i], qt->item_mass[i], qt->item_radius[i], &fx, &fy);
+    layout_node_t *ln = quadtree_get_item(qt, i);
+    ln->fx += fx;
+    ln->fy += fy;
+}
+
+/******************************************************************************/
+// grouped tree walk
+//
+// A group is a cell with at most group_size items.  It walks the tree once,
+// with the opening decisions made for all its items at once, and the list of
+// cells it approximates and leaves it does directly is then used for each of
+// its items, along with the other items of the group itself.
+//
+// While the quad tree is only refitted its cells keep their index, so the list
+// of a group can also be cached and reused for a few iterations, with the
+// current moments of the cells taken from the tree.  It is then recorded with
+// a margin for the group and the cells moving before it is recorded again.
+
+typedef struct _force_group_list_t {
+    int generation;     // a cached list is valid if this equals group_cache_generation
+    int age;            // number of times a cached list has been used
+    float x;            // centre of mass of the group when the list was recorded
+    float y;
+    int num;
+    int alloc;
+    int *list;          // cells q approximated by their moments, and ~q for leaves q done directly
+    int num_pairs;
+    int pairs_alloc;
+    int *pairs;         // leaves done as mutual pairs with this one, see below
+    int task_lo;        // items [task_lo, task_hi) are in the subtree of the current task
+    int task_hi;
+} force_group_list_t;
+
+static void group_list_add(force_group_list_t *gl, int entry) {
+    if (gl->num >= gl->alloc) {
+        gl->alloc = gl->alloc == 0 ? 64 : 2 * gl->alloc;
+        gl->list = m_renew(int, gl->list, gl->alloc);
+    }
+    gl->list[gl->num++] = entry;
+}
+
+static void group_list_add_pair(force_group_list_t *gl, int q) {
+    if (gl->num_pairs >= gl->pairs_alloc) {
+        gl->pairs_alloc = gl->pairs_alloc == 0 ? 16 : 2 * gl->pairs_alloc;
+        gl->pairs = m_renew(int, gl->pairs, gl->pairs_alloc);
+    }
+    gl->pairs[gl->num_pairs++] = q;
+}
+
+// whether the group at (x, y), whose items are all within extent of it, is
+// well separated from cell q2
+static inline bool group_is_well_separated(force_params_t *param, quadtree_t *qt, double x, double y, double extent, int q2) {
+    double dx = x - qt->x[q2];
+    double dy = y - qt->y[q2];
+    double r = sqrt(dx * dx + dy * dy) - extent;
+    return r > 0 && qt->side_length[q2] * qt->side_length[q2] < param->barnes_hut_opening * r * r;
+}
+
+// position in morton_order of the first item of cell q
+static int quad_tree_first_item(quadtree_t *qt, int q) {
+    while (!quadtree_is_leaf(qt, q)) {
+        q = qt->first[q];
+    }
+    return qt->first[q];
+}
+
+// distance from the centre of mass of group q to its furthest item
+static double group_extent(quadtree_t *qt, int q) {
+    double x = qt->x[q];
+    double y = qt->y[q];
+    double rsq = 0;
+    int i_lo = quad_tree_first_item(qt, q);
+    int i_hi = i_lo + qt->num_items[q];
+    for (int i = i_lo; i < i_hi; i++) {
+        double dx = qt->item_x[i] - x;
+        double dy = qt->item_y[i] - y;
+        rsq = fmax(rsq, dx * dx + dy * dy);
+    }
+    return sqrt(rsq);
+}
+
+// one cached list per cell of the quad tree, only used for the groups
+static int group_cache_alloc = 0;
+static force_group_list_t *group_cache = NULL;
+static int group_cache_generation = 0;
+static int group_cache_num_builds = 0;
+static bool group_cache_close_repulsion = false;
+static double group_cache_opening = 0;
+static int group_cache_group_size = 0;
+
+// invalidates all the cached lists if the tree was rebuilt or the parameters changed
+static void group_cache_prepare(force_params_t *param, quadtree_t *qt) {
+    if (qt->num_cells > group_cache_alloc) {
+        group_cache = m_renew(force_group_list_t, group_cache, qt->num_cells);
+        for (int q = group_cache_alloc; q < qt->num_cells; q++) {
+            group_cache[q].generation = 0;
+            group_cache[q].alloc = 0;
+            group_cache[q].list = NULL;
         }
+        group_cache_alloc = qt->num_cells;
+    }
+    if (group_cache_generation == 0
+        || qt->num_builds != group_cache_num_builds
+        || param->do_close_repulsion != group_cache_close_repulsion
+        || param->barnes_hut_opening != group_cache_opening
+        || param->barnes_hut_group_size != group_cache_group_size) {
+        group_cache_generation += 1;
+        group_cache_num_builds = qt->num_builds;
+        group_cache_close_repulsion = param->do_close_repulsion;
+        group_cache_opening = param->barnes_hut_opening;
+        group_cache_group_size = param->barnes_hut_group_size;
+    }
+}
 
-        if (q2->num_items == 1) {
-            // q2 is leaf node
-            double fac;
-            if (param->do_close_repulsion) {
-                double rad_sum_sq = param->close_repulsion_c * pow(param->close_repulsion_d + q1->radius + q2->radius, 2);
-                if (rsq < rad_sum_sq) {
-                    // layout-nodes overlap, use stronger repulsive force
-                    fac = param->close_repulsion_a * fmin(param->close_repulsion_b, (exp(4.0 * (rad_sum_sq - rsq)) - 1.0)) / rsq
-                        + q1->mass * q2->mass / rad_sum_sq;
-                } else {
-                    // normal anti-gravity repulsive force
-                    if (rsq > param->anti_gravity_falloff_rsq) { rsq *= rsq * param->anti_gravity_falloff_rsq_inv; }
-                    fac = q1->mass * q2->mass / rsq;
-                }
-            } else {
-                // normal anti-gravity repulsive force
-                if (rsq > param->anti_gravity_falloff_rsq) { rsq *= rsq * param->anti_gravity_falloff_rsq_inv; }
-                fac = q1->mass * q2->mass / rsq;
-            }
-            double fx = dx * fac;
-            double fy = dy * fac;
-            /*
-            q1->fx += fx;
-            q1->fy += fy;
-            q2->fx -= fx;
-            q2->fy -= fy;
-            */
-            ((layout_node_t*)q1->item)->fx += fx;
-            ((layout_node_t*)q1->item)->fy += fy;
+/******************************************************************************/
+// mutual near field
+//
+// With close repulsion, and without cached lists, each leaf can walk the tree
+// as a group, and a leaf b in the list of leaf a whose own walk also reaches a
+// (rather than approximating a cell above a) then forms a mutual pair with a.
+// The forces between their items are computed once, by whichever of the two
+// comes first in morton order, and accumulated for both in mutual_fx and
+// mutual_fy, which an item takes (and clears) when its force is evaluated.
+// Only pairs within the subtree of a single task are done this way, so that no
+// two threads write to the same items; pairs across subtrees are done from
+// both sides, as before.
+
+static int mutual_alloc = 0;
+static double *mutual_fx = NULL;
+static double *mutual_fy = NULL;
+
+static inline bool force_mutual_near_field(force_params_t *param) {
+    return param->do_close_repulsion && param->mutual_near_field && !param->cache_ilists;
+}
 
-        } else {
-            // q2 is internal node
-            if (q2->side_length * q2->side_length < 0.45 * rsq) {
-                // q1 and the cell q2 are "well separated"
-                // approximate force by centroid of q2
-                if (rsq > param->anti_gravity_falloff_rsq) { rsq *= rsq * param->anti_gravity_falloff_rsq_inv; }
-                double fac = q1->mass * q2->mass / rsq;
-                double fx = dx * fac;
-                double fy = dy * fac;
-                /*
-                q1->fx += fx;
-                q1->fy += fy;
-                q2->fx -= fx;
-                q2->fy -= fy;
-                */
-                ((layout_node_t*)q1->item)->fx += fx;
-                ((layout_node_t*)q1->item)->fy += fy;
-
-            } else {
-                // q1 and q2 are not "well separated"
-                // descend into children of q2
-                quad_tree_forces_leaf_vs_node(param, q1, q2->q0);
-                quad_tree_forces_leaf_vs_node(param, q1, q2->q1);
-                quad_tree_forces_leaf_vs_node(param, q1, q2->q2);
-                quad_tree_forces_leaf_vs_node(param, q1, q2->q3);
-            }
+static void mutual_prepare(int num_items) {
+    if (num_items > mutual_alloc) {
+        mutual_fx = m_renew(double, mutual_fx, num_items);
+        mutual_fy = m_renew(double, mutual_fy, num_items);
+        for (int i = mutual_alloc; i < num_items; i++) {
+            mutual_fx[i] = 0;
+            mutual_fy[i] = 0;
+        }
+        mutual_alloc = num_items;
+    }
+}
+
+// whether the walk of leaf b reaches leaf a, where a_top is the ancestor of a
+// (or a itself) whose sibling contains b; this must make the same decisions,
+// with the same arithmetic, as group_list_record for b
+static bool mutual_walk_reaches(force_params_t *param, quadtree_t *qt, int b, int a, int a_top) {
+    if (a == a_top) {
+        return true;
+    }
+    double extent = group_extent(qt, b);
+    for (int p = qt->parent[a];; p = qt->parent[p]) {
+        if (group_is_well_separated(param, qt, qt->x[b], qt->y[b], extent, p)) {
+            return false;
+        }
+        if (p == a_top) {
+            return true;
         }
     }
 }
 
-static void quad_tree_forces_ascend(force_params_t *param, quadtree_node_t *q) {
-    assert(q->num_items == 1); // must be a leaf node
-    for (quadtree_node_t *q2 = q; q2->parent != NULL; q2 = q2->parent) {
-        quadtree_node_t *parent = q2->parent;
-        assert(parent->num_items > 1); // all parents should be internal nodes
-        if (parent->q0 != q2) { quad_tree_forces_leaf_vs_node(param, q, parent->q0); }
-        if (parent->q1 != q2) { quad_tree_forces_leaf_vs_node(param, q, parent->q1); }
-        if (parent->q2 != q2) { quad_tree_forces_leaf_vs_node(param, q, parent->q2); }
-        if (parent->q3 != q2) { quad_tree_forces_leaf_vs_node(param, q, parent->q3); }
+// takes the mutual pairs out of the leaves added to the list of leaf a since
+// position k_lo, which are all in siblings of a_top; a pair is kept in the
+// pairs of a if a comes first, and is otherwise already done
+static void group_list_take_pairs(force_params_t *param, force_group_list_t *gl, quadtree_t *qt, int a, int a_top, int k_lo) {
+    int k_out = k_lo;
+    for (int k = k_lo; k < gl->num; k++) {
+        int entry = gl->list[k];
+        if (entry < 0) {
+            int b = ~entry;
+            if (qt->first[b] >= gl->task_lo && qt->first[b] < gl->task_hi && mutual_walk_reaches(param, qt, b, a, a_top)) {
+                if (qt->first[a] < qt->first[b]) {
+                    group_list_add_pair(gl, b);
+                }
+                continue;
+            }
+        }
+        gl->list[k_out++] = entry;
     }
+    gl->num = k_out;
 }
 
-static void quad_tree_forces_descend(force_params_t *param, quadtree_node_t *q) {
-    if (q->num_items == 1) {
-        quad_tree_forces_ascend(param, q);
+/******************************************************************************/
+// specialised variants of the tree walk
+
+#define FORCE_WALK_CLOSE_REPULSION (0)
+#define FORCE_WALK_NOT_HELD (0)
+#define FORCE_WALK(name) name ## _ag
+#include "forcewalk.h"
+
+#define FORCE_WALK_CLOSE_REPULSION (1)
+#define FORCE_WALK_NOT_HELD (0)
+#define FORCE_WALK(name) name ## _cr
+#include "forcewalk.h"
+
+#define FORCE_WALK_CLOSE_REPULSION (0)
+#define FORCE_WALK_NOT_HELD (1)
+#define FORCE_WALK(name) name ## _ag_not_held
+#include "forcewalk.h"
+
+#define FORCE_WALK_CLOSE_REPULSION (1)
+#define FORCE_WALK_NOT_HELD (1)
+#define FORCE_WALK(name) name ## _cr_not_held
+#include "forcewalk.h"
+
+typedef void (*force_descend_fun_t)(force_params_t *param, force_ilist_t *il, force_group_list_t *gl, quadtree_t *qt, int q);
+
+// the variant of the walk for the current parameters, chosen once per iteration
+static force_descend_fun_t force_descend_select(force_params_t *param, bool not_held) {
+    if (param->do_close_repulsion) {
+        return not_held ? quad_tree_forces_descend_cr_not_held : quad_tree_forces_descend_cr;
     } else {
-        if (q->q0 != NULL) { quad_tree_forces_descend(param, q->q0); }
-        if (q->q1 != NULL) { quad_tree_forces_descend(param, q->q1); }
-        if (q->q2 != NULL) { quad_tree_forces_descend(param, q->q2); }
-        if (q->q3 != NULL) { quad_tree_forces_descend(param, q->q3); }
+        return not_held ? quad_tree_forces_descend_ag_not_held : quad_tree_forces_descend_ag;
+    }
+}
+
+// subtrees of the quad tree whose forces can be computed independently, one per task
+static int subtrees_alloc = 0;
+static int num_subtrees = 0;
+static int *subtrees = NULL;
+
+static void subtrees_add(int q) {
+    if (num_subtrees >= subtrees_alloc) {
+        subtrees_alloc = subtrees_alloc == 0 ? 256 : 2 * subtrees_alloc;
+        subtrees = m_renew(int, subtrees, subtrees_alloc);
     }
+    subtrees[num_subtrees++] = q;
 }
 
-/*
-static void quad_tree_node_forces_propagate(quadtree_node_t *q, double fx, double fy) {
-    if (q == NULL) {
+static void subtrees_collect(quadtree_t *qt, int q, int depth) {
+    if (depth == 0 || quadtree_is_leaf(qt, q)) {
+        subtrees_add(q);
     } else {
-        fx *= q->mass;
-        fy *= q->mass;
-        fx += q->fx;
-        fy += q->fy;
-
-        if (q->num_items == 1) {
-            ((layout_node_t*)q->item)->fx += fx;
-            ((layout_node_t*)q->item)->fy += fy;
-        } else {
-            fx /= q->mass;
-            fy /= q->mass;
-            quad_tree_node_forces_propagate(q->q0, fx, fy);
-            quad_tree_node_forces_propagate(q->q1, fx, fy);
-            quad_tree_node_forces_propagate(q->q2, fx, fy);
-            quad_tree_node_forces_propagate(q->q3, fx, fy);
+        int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+        for (int c = qt->first[q]; c < c_hi; c++) {
+            subtrees_collect(qt, c, depth - 1);
         }
     }
 }
-*/
-
-#include <pthread.h>
 
-typedef struct _multi_env_t {
-    pthread_t pthread;
-    pthread_barrier_t b_start, b_end;
-    force_params_t *param;
-    quadtree_node_t *q;
-} multi_env_t;
-
-static bool th_created = false;
-multi_env_t th_me1, th_me1, th_me2, th_me3;
-
-// this function is the worker thread that calls quad_tree_forces_descend when needed
-static void *th_entry(void *env_in) {
-    multi_env_t *env = env_in;
-    for (;;) {
-        pthread_barrier_wait(&env->b_start);
-        if (env->q != NULL) {
-            quad_tree_forces_descend(env->param, env->q);
+// one interaction list and group list per thread, reused between iterations
+static int num_ilists = 0;
+static force_ilist_t *ilists = NULL;
+static force_group_list_t *group_lists = NULL;
+
+static void ilists_init(int num_threads) {
+    if (num_ilists < num_threads) {
+        ilists = m_renew(force_ilist_t, ilists, num_threads);
+        group_lists = m_renew(force_group_list_t, group_lists, num_threads);
+        for (int i = num_ilists; i < num_threads; i++) {
+            force_ilist_init(&ilists[i]);
+            group_lists[i].alloc = 0;
+            group_lists[i].list = NULL;
+            group_lists[i].pairs_alloc = 0;
+            group_lists[i].pairs = NULL;
         }
-        pthread_barrier_wait(&env->b_end);
+        num_ilists = num_threads;
+        printf("using %s force kernel\n", force_kernel_name());
     }
-    return NULL;
+}
+
+typedef struct _force_tree_env_t {
+    force_params_t *param;
+    quadtree_t *qt;
+    force_descend_fun_t descend;
+} force_tree_env_t;
+
+static void force_tree_task(void *env_in, int task, int thread) {
+    force_tree_env_t *env = env_in;
+    force_group_list_t *gl = &group_lists[thread];
+    gl->task_lo = quad_tree_first_item(env->qt, subtrees[task]);
+    gl->task_hi = gl->task_lo + env->qt->num_items[subtrees[task]];
+    env->descend(env->param, &ilists[thread], gl, env->qt, subtrees[task]);
 }
 
 // descending then ascending is almost twice as fast (for large graphs) as
 // just naively iterating through all the leaves, possibly due to cache effects
-void force_quad_tree_forces(force_params_t *param, quadtree_t *qt) {
-
-    // initialise threads on the first call
-    if (!th_created) {
-        pthread_barrier_init(&th_me1.b_start, NULL, 2);
-        pthread_barrier_init(&th_me1.b_end, NULL, 2);
-        pthread_barrier_init(&th_me2.b_start, NULL, 2);
-        pthread_barrier_init(&th_me2.b_end, NULL, 2);
-        pthread_barrier_init(&th_me3.b_start, NULL, 2);
-        pthread_barrier_init(&th_me3.b_end, NULL, 2);
-        pthread_create(&th_me1.pthread, NULL, th_entry, &th_me1);
-        pthread_create(&th_me2.pthread, NULL, th_entry, &th_me2);
-        pthread_create(&th_me3.pthread, NULL, th_entry, &th_me3);
-        th_created = true;
-    }
-
-    if (qt->root != NULL) {
-        if (qt->root->num_items == 1 || 0) {
+static void force_quad_tree_walk(force_params_t *param, quadtree_t *qt, bool not_held) {
+    if (qt->num_cells > 0) {
+        int num_threads = threadpool_get_num_threads();
+        ilists_init(num_threads);
+        if (param->cache_ilists) {
+            group_cache_prepare(param, qt);
+        }
+        if (force_mutual_near_field(param)) {
+            mutual_prepare(qt->num_items[QUADTREE_ROOT]);
+        }
+        force_descend_fun_t descend = force_descend_select(param, not_held);
+        if (num_threads == 1 || quadtree_is_leaf(qt, QUADTREE_ROOT)) {
             // without threading
-            quad_tree_forces_descend(param, qt->root);
+            group_lists[0].task_lo = 0;
+            group_lists[0].task_hi = qt->num_items[QUADTREE_ROOT];
+            descend(param, &ilists[0], &group_lists[0], qt, QUADTREE_ROOT);
         } else {
             // with threading
 
-            // set parameters for worker threads
-            th_me1.param = param;
-            th_me1.q = qt->root->q0;
-            th_me2.param = param;
-            th_me2.q = qt->root->q1;
-            th_me3.param = param;
-            th_me3.q = qt->root->q2;
-
-            // start worker threads
-            pthread_barrier_wait(&th_me1.b_start);
-            pthread_barrier_wait(&th_me2.b_start);
-            pthread_barrier_wait(&th_me3.b_start);
-
-            // do our own work
-            if (qt->root->q3 != NULL) {
-                quad_tree_forces_descend(param, qt->root->q3);
+            // split the tree into many more subtrees than there are threads, so
+            // that threads finishing a sparse part of the map can steal work
+            int depth = 1;
+            while ((1 << (2 * depth)) < FORCE_SUBTREES_PER_THREAD * num_threads) {
+                depth += 1;
             }
+            num_subtrees = 0;
+            subtrees_collect(qt, QUADTREE_ROOT, depth);
 
-            // wait for all worker threads to finish
-            pthread_barrier_wait(&th_me1.b_end);
-            pthread_barrier_wait(&th_me2.b_end);
-            pthread_barrier_wait(&th_me3.b_end);
+            force_tree_env_t env = {param, qt, descend};
+            threadpool_run(num_subtrees, force_tree_task, &env);
         }
-        //quad_tree_node_forces_propagate(qt->root, 0, 0);
     }
 }
 
-void force_quad_tree_apply_if(force_params_t *param, quadtree_t *qt, bool (*f)(layout_node_t*)) {
-    if (qt->root != NULL) {
-        for (quadtree_pool_t *qtp = qt->quad_tree_pool; qtp != NULL; qtp = qtp->next) {
-            for (int i = 0; i < qtp->num_nodes_used; i++) {
-                quadtree_node_t *q = &qtp->nodes[i];
-                if (q->num_items == 1 && f((layout_node_t*)q->item)) {
-                    //quad_tree_forces_leaf_vs_node(param, q, qt->root);
-                    quad_tree_forces_ascend(param, q);
+void force_quad_tree_forces(force_params_t *param, quadtree_t *qt) {
+    force_quad_tree_walk(param, qt, false);
+}
+
+void force_quad_tree_forces_not_held(force_params_t *param, quadtree_t *qt) {
+    force_quad_tree_walk(param, qt, true);
+}
+
+/******************************************************************************/
+// close repulsion from a cell list
+//
+// Close repulsion only changes the force between layout-nodes that overlap,
+// so instead of doing the leaves directly in the tree walk the tree can
+// compute anti-gravity alone, with the difference for the overlapping pairs
+// added here.  The neighbours of each layout-node are found with a hash of a
+// uniform grid whose cells are the largest overlap distance plus a skin, and
+// the list is kept until a layout-node has moved more than half the skin, or
+// its radius has changed.  Each layout-node has all its neighbours in its own
+// list, so every pair is done from both sides and each thread only writes to
+// the layout-nodes of its own chunk.
+//
+// The layout-nodes are kept in the order of their hash bucket, and their
+// positions are copied into flat arrays in that order at each iteration, so
+// that the neighbours of a layout-node are mostly close by in memory.
+
+// the neighbours are found and the forces computed for chunks of layout-nodes, this many per thread
+#define FORCE_NEAR_CHUNKS_PER_THREAD (16)
+
+typedef struct _force_near_chunk_t {
+    bool stale;         // whether a layout-node of the chunk has moved too far
+    int num;
+    int alloc;
+    int *nbr;           // position of the neighbouring layout-nodes
+} force_near_chunk_t;
+
+// the state the neighbour list was built for
+static layout_t *near_layout = NULL;
+static layout_node_t *near_nodes = NULL;
+static int near_num_nodes = 0;
+static double near_c = 0;
+static double near_d = 0;
+static double near_skin = 0;
+static double near_cell = 0;
+
+// per layout-node, by position in the order of the hash buckets
+static int near_alloc = 0;
+static int *near_order = NULL;      // index of the layout-node at each position
+static float *near_x = NULL;        // current position, radius and mass
+static float *near_y = NULL;
+static float *near_r = NULL;
+static float *near_m = NULL;
+static float *near_x0 = NULL;       // position and radius when the list was built
+static float *near_y0 = NULL;
+static float *near_r0 = NULL;
+static int *near_start = NULL;      // neighbours are nbr[near_start[p]] onwards, in the chunk of p
+static int *near_num = NULL;
+
+static int buckets_alloc = 0;
+static int num_buckets = 0;         // a power of 2
+static int *bucket_start = NULL;
+static int near_chunks_alloc = 0;
+static int num_near_chunks = 0;
+static force_near_chunk_t *near_chunks = NULL;
+
+static inline int near_bucket(int cx, int cy) {
+    return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & (num_buckets - 1);
+}
+
+static inline int near_cell_coord(float x) {
+    return (int)floor(x / near_cell);
+}
+
+static void near_chunk_add(force_near_chunk_t *chunk, int q) {
+    if (chunk->num >= chunk->alloc) {
+        chunk->alloc = chunk->alloc == 0 ? 1024 : 2 * chunk->alloc;
+        chunk->nbr = m_renew(int, chunk->nbr, chunk->alloc);
+    }
+    chunk->nbr[chunk->num++] = q;
+}
+
+typedef struct _force_near_env_t {
+    force_params_t *param;
+    layout_t *layout;
+    bool not_held;
+} force_near_env_t;
+
+// copy the current positions of a chunk, and check whether any has moved too far
+static void near_gather_task(void *env_in, int chunk_index, int thread) {
+    force_near_env_t *env = env_in;
+    force_near_chunk_t *chunk = &near_chunks[chunk_index];
+    int lo = (int64_t)near_num_nodes * chunk_index / num_near_chunks;
+    int hi = (int64_t)near_num_nodes * (chunk_index + 1) / num_near_chunks;
+    double max_move_sq = 0.25 * near_skin * near_skin;
+    bool stale = false;
+    for (int p = lo; p < hi; p++) {
+        layout_node_t *n = &env->layout->nodes[near_order[p]];
+        near_x[p] = n->x;
+        near_y[p] = n->y;
+        near_r[p] = n->radius;
+        near_m[p] = n->mass;
+        double dx = near_x[p] - near_x0[p];
+        double dy = near_y[p] - near_y0[p];
+        stale |= dx * dx + dy * dy > max_move_sq || near_r[p] != near_r0[p];
+    }
+    chunk->stale = stale;
+}
+
+static void near_build_task(void *env_in, int chunk_index, int thread) {
+    force_near_chunk_t *chunk = &near_chunks[chunk_index];
+    int lo = (int64_t)near_num_nodes * chunk_index / num_near_chunks;
+    int hi = (int64_t)near_num_nodes * (chunk_index + 1) / num_near_chunks;
+    double sqrt_c = sqrt(near_c);
+    chunk->num = 0;
+    for (int p = lo; p < hi; p++) {
+        double x = near_x0[p];
+        double y = near_y0[p];
+        int cx = near_cell_coord(near_x0[p]);
+        int cy = near_cell_coord(near_y0[p]);
+        near_start[p] = chunk->num;
+
+        // the 3x3 cells around, each bucket only once in case of collisions
+        int seen[9];
+        int num_seen = 0;
+        for (int k = 0; k < 9; k++) {
+            int b = near_bucket(cx + k % 3 - 1, cy + k / 3 - 1);
+            bool done = false;
+            for (int s = 0; s < num_seen; s++) {
+                done |= seen[s] == b;
+            }
+            if (done) {
+                continue;
+            }
+            seen[num_seen++] = b;
+            for (int q = bucket_start[b]; q < bucket_start[b + 1]; q++) {
+                if (q == p) {
+                    continue;
+                }
+                double dx = x - near_x0[q];
+                double dy = y - near_y0[q];
+                double cut = sqrt_c * (near_d + near_r0[p] + near_r0[q]) + near_skin;
+                if (dx * dx + dy * dy < cut * cut) {
+                    near_chunk_add(chunk, q);
                 }
             }
         }
-        //quad_tree_node_forces_propagate(qt->root, 0, 0);
+        near_num[p] = chunk->num - near_start[p];
+    }
+}
+
+// (re)build the neighbour list for the current positions and radii
+static void near_build(force_near_env_t *env) {
+    force_params_t *param = env->param;
+    layout_t *layout = env->layout;
+    int n = layout->num_nodes;
+    near_layout = layout;
+    near_nodes = layout->nodes;
+    near_num_nodes = n;
+    near_c = param->close_repulsion_c;
+    near_d = param->close_repulsion_d;
+    near_skin = param->close_repulsion_skin;
+
+    if (n > near_alloc) {
+        near_alloc = n;
+        near_order = m_renew(int, near_order, near_alloc);
+        near_x = m_renew(float, near_x, near_alloc);
+        near_y = m_renew(float, near_y, near_alloc);
+        near_r = m_renew(float, near_r, near_alloc);
+        near_m = m_renew(float, near_m, near_alloc);
+        near_x0 = m_renew(float, near_x0, near_alloc);
+        near_y0 = m_renew(float, near_y0, near_alloc);
+        near_r0 = m_renew(float, near_r0, near_alloc);
+        near_start = m_renew(int, near_start, near_alloc);
+        near_num = m_renew(int, near_num, near_alloc);
+    }
+
+    // the cells are large enough that all neighbours are in the 3x3 cells around
+    double r_max = 0;
+    for (int i = 0; i < n; i++) {
+        r_max = fmax(r_max, layout->nodes[i].radius);
+    }
+    near_cell = sqrt(near_c) * (near_d + 2 * r_max) + near_skin;
+    num_buckets = 1;
+    while (num_buckets < 2 * n) {
+        num_buckets *= 2;
+    }
+    if (num_buckets + 1 > buckets_alloc) {
+        buckets_alloc = num_buckets + 1;
+        bucket_start = m_renew(int, bucket_start, buckets_alloc);
+    }
+
+    // sort the layout-nodes by bucket, using near_start for the bucket of each
+    for (int b = 0; b <= num_buckets; b++) {
+        bucket_start[b] = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        near_start[i] = near_bucket(near_cell_coord(layout->nodes[i].x), near_cell_coord(layout->nodes[i].y));
+        bucket_start[near_start[i] + 1] += 1;
+    }
+    for (int b = 0; b < num_buckets; b++) {
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    for (int i = 0; i < n; i++) {
+        near_order[bucket_start[near_start[i]]++] = i;
+    }
+    for (int b = num_buckets; b > 0; b--) {
+        bucket_start[b] = bucket_start[b - 1];
+    }
+    bucket_start[0] = 0;
+
+    num_near_chunks = FORCE_NEAR_CHUNKS_PER_THREAD * threadpool_get_num_threads();
+    if (num_near_chunks > near_chunks_alloc) {
+        near_chunks = m_renew(force_near_chunk_t, near_chunks, num_near_chunks);
+        for (int k = near_chunks_alloc; k < num_near_chunks; k++) {
+            near_chunks[k].num = 0;
+            near_chunks[k].alloc = 0;
+            near_chunks[k].nbr = NULL;
+        }
+        near_chunks_alloc = num_near_chunks;
+    }
+
+    // copy the positions in the new order, then find the neighbours of each chunk in parallel
+    threadpool_run(num_near_chunks, near_gather_task, env);
+    memcpy(near_x0, near_x, n * sizeof(float));
+    memcpy(near_y0, near_y, n * sizeof(float));
+    memcpy(near_r0, near_r, n * sizeof(float));
+    threadpool_run(num_near_chunks, near_build_task, NULL);
+}
+
+static void near_force_task(void *env_in, int chunk_index, int thread) {
+    force_near_env_t *env = env_in;
+    force_params_t *param = env->param;
+    const int *nbr = near_chunks[chunk_index].nbr;
+    int lo = (int64_t)near_num_nodes * chunk_index / num_near_chunks;
+    int hi = (int64_t)near_num_nodes * (chunk_index + 1) / num_near_chunks;
+    for (int p = lo; p < hi; p++) {
+        layout_node_t *n1 = &env->layout->nodes[near_order[p]];
+        if (env->not_held && (n1->flags & LAYOUT_NODE_HOLD_STILL)) {
+            continue;
+        }
+        double x = near_x[p];
+        double y = near_y[p];
+        double fx = 0;
+        double fy = 0;
+        int k_hi = near_start[p] + near_num[p];
+        for (int k = near_start[p]; k < k_hi; k++) {
+            int q = nbr[k];
+            double dx = x - near_x[q];
+            double dy = y - near_y[q];
+            double rsq = dx * dx + dy * dy;
+            if (rsq < 1e-6) {
+                // minimum distance cut-off
+                rsq = 1e-6;
+            }
+            double rad_sum = param->close_repulsion_d + near_r[p] + near_r[q];
+            if (rsq < param->close_repulsion_c * rad_sum * rad_sum) {
+                // replace the anti-gravity the tree computed for this pair by close repulsion
+                double m1m2 = near_m[p] * near_m[q];
+                double fac = force_kernel_close_repulsion_fac(param, m1m2, near_r[p], near_r[q], rsq)
+                    - force_kernel_anti_gravity_fac(param, m1m2, rsq);
+                fx += dx * fac;
+                fy += dy * fac;
+            }
+        }
+        n1->fx += fx;
+        n1->fy += fy;
+    }
+}
+
+// adds the difference between close repulsion and anti-gravity for the pairs
+// of layout-nodes that overlap, to all of them or only to those not held
+void force_close_repulsion_cell_list(force_params_t *param, layout_t *layout, bool not_held) {
+    if (layout->num_nodes == 0) {
+        return;
+    }
+    force_near_env_t env = {param, layout, not_held};
+    if (layout != near_layout || layout->nodes != near_nodes || layout->num_nodes != near_num_nodes
+        || param->close_repulsion_c != near_c || param->close_repulsion_d != near_d || param->close_repulsion_skin != near_skin) {
+        near_build(&env);
+    } else {
+        threadpool_run(num_near_chunks, near_gather_task, &env);
+        bool stale = false;
+        for (int k = 0; k < num_near_chunks; k++) {
+            stale |= near_chunks[k].stale;
+        }
+        if (stale) {
+            near_build(&env);
+        }
     }
+    threadpool_run(num_near_chunks, near_force_task, &env);
 }
@@ -4,23 +4,44 @@
 #include "layout.h"
 #include "quadtree.h"
 
+// solvers for the anti-gravity force
+#define FORCE_SOLVER_BARNES_HUT (0)
+#define FORCE_SOLVER_FMM        (1)
+#define FORCE_SOLVER_DUAL_TREE  (2)
+
 typedef struct _force_params_t {
     bool do_close_repulsion;
     double close_repulsion_a;
     double close_repulsion_b;
     double close_repulsion_c;
     double close_repulsion_d;
+    bool fast_close_repulsion;  // use an approximate exp for overlapping layout-nodes
     bool use_ref_freq;
     double anti_gravity_falloff_rsq;
     double anti_gravity_falloff_rsq_inv;
     double link_strength;
+    double barnes_hut_opening;  // a cell is well separated if side_length^2 < barnes_hut_opening * distance^2
+    int barnes_hut_group_size;  // cells with at most this many items walk the tree once for all of them; 0 to walk per item
+    int anti_gravity_solver;    // one of FORCE_SOLVER_xxx
+    int fmm_order;              // number of terms in the expansions of the FMM solver
+    bool cache_ilists;          // reuse the interaction list of each group (or leaf) while the quad tree is only refitted
+    bool mutual_near_field;     // with close repulsion, do each pair of neighbouring leaves once, for both
+    bool close_repulsion_cell_list; // do close repulsion from a neighbour list, and only anti-gravity with the tree
+    double close_repulsion_skin;    // the neighbour list is built again once a layout-node moves half this distance
 } force_params_t;
 
 struct _quadtree_t;
 
 void force_quad_tree_forces(force_params_t *param, struct _quadtree_t *qt);
-void force_quad_tree_apply_if(force_params_t *param, struct _quadtree_t *qt, bool (*f)(layout_node_t*));
+void force_quad_tree_forces_not_held(force_params_t *param, struct _quadtree_t *qt);
+
+void force_close_repulsion_cell_list(force_params_t *param, layout_t *layout, bool not_held);
 
 void force_compute_attractive_link_force(force_params_t *param, bool do_tred, layout_t *layout);
 
+// as above, but with threads the link forces are queued to run alongside the
+// next batch of the thread pool, and are only done after threadpool_run_queued;
+// the layout-nodes must keep their positions and forces until then
+void force_queue_attractive_link_force(force_params_t *param, bool do_tred, layout_t *layout);
+
 #endif // _INCLUDED_FORCE_H
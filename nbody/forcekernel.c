@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <math.h>
+#include <immintrin.h>
+
+#include "util/xiwilib.h"
+#include "force.h"
+#include "forcekernel.h"
+
+void force_ilist_init(force_ilist_t *il) {
+    il->num_cells = 0;
+    il->cells_alloc = 0;
+    il->cell_x = NULL;
+    il->cell_y = NULL;
+    il->cell_mass = NULL;
+    il->cell_q_xx = NULL;
+    il->cell_q_xy = NULL;
+    il->num_leaves = 0;
+    il->leaves_alloc = 0;
+    il->leaf_x = NULL;
+    il->leaf_y = NULL;
+    il->leaf_mass = NULL;
+    il->leaf_radius = NULL;
+    il->leaf_fx = NULL;
+    il->leaf_fy = NULL;
+}
+
+void force_ilist_reset(force_ilist_t *il) {
+    il->num_cells = 0;
+    il->num_leaves = 0;
+}
+
+void force_ilist_grow_cells(force_ilist_t *il) {
+    il->cells_alloc = il->cells_alloc == 0 ? 256 : 2 * il->cells_alloc;
+    il->cell_x = m_renew(double, il->cell_x, il->cells_alloc);
+    il->cell_y = m_renew(double, il->cell_y, il->cells_alloc);
+    il->cell_mass = m_renew(double, il->cell_mass, il->cells_alloc);
+    il->cell_q_xx = m_renew(double, il->cell_q_xx, il->cells_alloc);
+    il->cell_q_xy = m_renew(double, il->cell_q_xy, il->cells_alloc);
+}
+
+void force_ilist_grow_leaves(force_ilist_t *il) {
+    il->leaves_alloc = il->leaves_alloc == 0 ? 64 : 2 * il->leaves_alloc;
+    il->leaf_x = m_renew(double, il->leaf_x, il->leaves_alloc);
+    il->leaf_y = m_renew(double, il->leaf_y, il->leaves_alloc);
+    il->leaf_mass = m_renew(double, il->leaf_mass, il->leaves_alloc);
+    il->leaf_radius = m_renew(double, il->leaf_radius, il->leaves_alloc);
+    il->leaf_fx = m_renew(double, il->leaf_fx, il->leaves_alloc);
+    il->leaf_fy = m_renew(double, il->leaf_fy, il->leaves_alloc);
+}
+
+/******************************************************************************/
+// scalar kernels, used as the fallback and for the tail of the vector loops
+
+static void kernel_cells_scalar(force_params_t *param, int i, int n, const double *cx, const double *cy, const double *cm, const double *cq_xx, const double *cq_xy, double x, double y, double mass, double *fx_inout, double *fy_inout) {
+    double fx = 0;
+    double fy = 0;
+    for (; i < n; i++) {
+        double dx = x - cx[i];
+        double dy = y - cy[i];
+        double rsq = dx * dx + dy * dy;
+        if (rsq < 1e-6) {
+            // minimum distance cut-off
+            rsq = 1e-6;
+        }
+        double fac = force_kernel_anti_gravity_fac(param, mass * cm[i], rsq);
+        fx += dx * fac;
+        fy += dy * fac;
+        if (rsq <= param->anti_gravity_falloff_rsq) {
+            force_kernel_quadrupole(mass, cq_xx[i], cq_xy[i], dx, dy, rsq, &fx, &fy);
+        }
+    }
+    *fx_inout += fx;
+    *fy_inout += fy;
+}
+
+static void kernel_leaves_scalar(force_params_t *param, int i, int n, const double *lx, const double *ly, const double *lm, const double *lr, double x, double y, double mass, double radius, double *fx_inout, double *fy_inout) {
+    double fx = 0;
+    double fy = 0;
+    for (; i < n; i++) {
+        double dx = x - lx[i];
+        double dy = y - ly[i];
+        double rsq = dx * dx + dy * dy;
+        if (rsq < 1e-6) {
+            // minimum distance cut-off
+            rsq = 1e-6;
+        }
+        double fac = force_kernel_close_repulsion_fac(param, mass * lm[i], radius, lr[i], rsq);
+        fx += dx * fac;
+        fy += dy * fac;
+    }
+    *fx_inout += fx;
+    *fy_inout += fy;
+}
+
+static void kernel_eval_scalar(force_params_t *param, force_ilist_t *il, double x, double y, double mass, double radius, double *fx, double *fy) {
+    kernel_cells_scalar(param, 0, il->num_cells, il->cell_x, il->cell_y, il->cell_mass, il->cell_q_xx, il->cell_q_xy, x, y, mass, fx, fy);
+    kernel_leaves_scalar(param, 0, il->num_leaves, il->leaf_x, il->leaf_y, il->leaf_mass, il->leaf_radius, x, y, mass, radius, fx, fy);
+}
+
+/******************************************************************************/
+// AVX2 kernels, 4 interactions at a time
+
+__attribute__((target("avx2,fma")))
+static inline double avx2_hsum(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+// force_kernel_fast_expm1, 4 at a time
+__attribute__((target("avx2,fma")))
+static inline __m256d avx2_fast_expm1(__m256d x) {
+    const __m256d v_one = _mm256_set1_pd(1.0);
+    const __m256d v_magic = _mm256_set1_pd(6755399441055744.0); // 1.5 * 2^52
+    x = _mm256_min_pd(x, _mm256_set1_pd(FORCE_KERNEL_FAST_EXPM1_MAX_X));
+    __m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(0.6931471805599453), x);
+    __m256d p = _mm256_set1_pd(1.0 / 362880);
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 40320));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 5040));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 720));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 120));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 24));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 6));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 2));
+    p = _mm256_fmadd_pd(p, r, v_one);
+    p = _mm256_mul_pd(p, r);
+    // 2^k, by putting k + 1023 in the exponent bits
+    __m256i k_int = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(k, v_magic)), _mm256_castpd_si256(v_magic));
+    __m256d two_k = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(k_int, _mm256_set1_epi64x(1023)), 52));
+    return _mm256_fmadd_pd(two_k, p, _mm256_sub_pd(two_k, v_one));
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_eval_avx2(force_params_t *param, force_ilist_t *il, double x, double y, double mass, double radius, double *fx, double *fy) {
+    const __m256d v_x = _mm256_set1_pd(x);
+    const __m256d v_y = _mm256_set1_pd(y);
+    const __m256d v_mass = _mm256_set1_pd(mass);
+    const __m256d v_rsq_min = _mm256_set1_pd(1e-6);
+    const __m256d v_falloff = _mm256_set1_pd(param->anti_gravity_falloff_rsq);
+    const __m256d v_falloff_inv = _mm256_set1_pd(param->anti_gravity_falloff_rsq_inv);
+    const __m256d v_one = _mm256_set1_pd(1.0);
+    const __m256d v_two = _mm256_set1_pd(2.0);
+    const __m256d v_three = _mm256_set1_pd(3.0);
+    __m256d v_fx = _mm256_setzero_pd();
+    __m256d v_fy = _mm256_setzero_pd();
+
+    // well-separated cells
+    int n = il->num_cells;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d dx = _mm256_sub_pd(v_x, _mm256_loadu_pd(&il->cell_x[i]));
+        __m256d dy = _mm256_sub_pd(v_y, _mm256_loadu_pd(&il->cell_y[i]));
+        __m256d dx2 = _mm256_mul_pd(dx, dx);
+        __m256d dy2 = _mm256_mul_pd(dy, dy);
+        __m256d rsq = _mm256_max_pd(_mm256_add_pd(dx2, dy2), v_rsq_min);
+        __m256d far = _mm256_cmp_pd(rsq, v_falloff, _CMP_GT_OQ);
+        __m256d rsq_f = _mm256_blendv_pd(rsq, _mm256_mul_pd(_mm256_mul_pd(rsq, rsq), v_falloff_inv), far);
+        __m256d fac = _mm256_div_pd(_mm256_mul_pd(v_mass, _mm256_loadu_pd(&il->cell_mass[i])), rsq_f);
+        v_fx = _mm256_fmadd_pd(dx, fac, v_fx);
+        v_fy = _mm256_fmadd_pd(dy, fac, v_fy);
+
+        // quadrupole correction, for cells within the falloff distance
+        __m256d a = _mm256_mul_pd(dx, _mm256_fnmadd_pd(v_three, dy2, dx2));
+        __m256d b = _mm256_mul_pd(dy, _mm256_fnmadd_pd(v_three, dx2, dy2));
+        __m256d inv = _mm256_div_pd(v_one, rsq);
+        __m256d inv3 = _mm256_mul_pd(v_mass, _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv)));
+        inv3 = _mm256_andnot_pd(far, inv3);
+        __m256d q_xx = _mm256_loadu_pd(&il->cell_q_xx[i]);
+        __m256d q_xy2 = _mm256_mul_pd(v_two, _mm256_loadu_pd(&il->cell_q_xy[i]));
+        v_fx = _mm256_fmadd_pd(inv3, _mm256_fmsub_pd(q_xx, a, _mm256_mul_pd(q_xy2, b)), v_fx);
+        v_fy = _mm256_fnmadd_pd(inv3, _mm256_fmadd_pd(q_xx, b, _mm256_mul_pd(q_xy2, a)), v_fy);
+    }
+    kernel_cells_scalar(param, i, n, il->cell_x, il->cell_y, il->cell_mass, il->cell_q_xx, il->cell_q_xy, x, y, mass, fx, fy);
+
+    // neighbouring leaves; compute anti-gravity for all 4 and fix up any that overlap
+    n = il->num_leaves;
+    i = 0;
+    if (n >= 4) {
+        const __m256d v_cr_a = _mm256_set1_pd(param->close_repulsion_a);
+        const __m256d v_cr_b = _mm256_set1_pd(param->close_repulsion_b);
+        const __m256d v_cr_c = _mm256_set1_pd(param->close_repulsion_c);
+        const __m256d v_cr_d_r1 = _mm256_set1_pd(param->close_repulsion_d + radius);
+        const __m256d v_four = _mm256_set1_pd(4.0);
+        for (; i + 4 <= n; i += 4) {
+            __m256d dx = _mm256_sub_pd(v_x, _mm256_loadu_pd(&il->leaf_x[i]));
+            __m256d dy = _mm256_sub_pd(v_y, _mm256_loadu_pd(&il->leaf_y[i]));
+            __m256d rsq = _mm256_max_pd(_mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy)), v_rsq_min);
+            __m256d rad_sum = _mm256_add_pd(v_cr_d_r1, _mm256_loadu_pd(&il->leaf_radius[i]));
+            __m256d rad_sum_sq = _mm256_mul_pd(v_cr_c, _mm256_mul_pd(rad_sum, rad_sum));
+            __m256d overlap_mask = _mm256_cmp_pd(rsq, rad_sum_sq, _CMP_LT_OQ);
+            int overlap = _mm256_movemask_pd(overlap_mask);
+            __m256d far = _mm256_cmp_pd(rsq, v_falloff, _CMP_GT_OQ);
+            __m256d rsq_f = _mm256_blendv_pd(rsq, _mm256_mul_pd(_mm256_mul_pd(rsq, rsq), v_falloff_inv), far);
+            __m256d m1m2 = _mm256_mul_pd(v_mass, _mm256_loadu_pd(&il->leaf_mass[i]));
+            __m256d fac = _mm256_div_pd(m1m2, rsq_f);
+            if (overlap && param->fast_close_repulsion) {
+                __m256d e = avx2_fast_expm1(_mm256_mul_pd(v_four, _mm256_sub_pd(rad_sum_sq, rsq)));
+                __m256d fac_cr = _mm256_div_pd(_mm256_mul_pd(v_cr_a, _mm256_min_pd(e, v_cr_b)), rsq);
+                fac_cr = _mm256_add_pd(fac_cr, _mm256_div_pd(m1m2, rad_sum_sq));
+                fac = _mm256_blendv_pd(fac, fac_cr, overlap_mask);
+            } else if (overlap) {
+                double fac_lane[4];
+                _mm256_storeu_pd(fac_lane, fac);
+                for (int j = 0; j < 4; j++) {
+                    if (overlap & (1 << j)) {
+                        double ddx = x - il->leaf_x[i + j];
+                        double ddy = y - il->leaf_y[i + j];
+                        fac_lane[j] = force_kernel_close_repulsion_fac(param, mass * il->leaf_mass[i + j], radius, il->leaf_radius[i + j], fmax(ddx * ddx + ddy * ddy, 1e-6));
+                    }
+                }
+                fac = _mm256_loadu_pd(fac_lane);
+            }
+            v_fx = _mm256_fmadd_pd(dx, fac, v_fx);
+            v_fy = _mm256_fmadd_pd(dy, fac, v_fy);
+        }
+    }
+    kernel_leaves_scalar(param, i, n, il->leaf_x, il->leaf_y, il->leaf_mass, il->leaf_radius, x, y, mass, radius, fx, fy);
+
+    *fx += avx2_hsum(v_fx);
+    *fy += avx2_hsum(v_fy);
+}
+
+/******************************************************************************/
+// AVX-512 kernels, 8 interactions at a time
+
+// force_kernel_fast_expm1, 8 at a time
+__attribute__((target("avx512f")))
+static inline __m512d avx512_fast_expm1(__m512d x) {
+    const __m512d v_one = _mm512_set1_pd(1.0);
+    x = _mm512_min_pd(x, _mm512_set1_pd(FORCE_KERNEL_FAST_EXPM1_MAX_X));
+    __m512d k = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(1.4426950408889634)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(k, _mm512_set1_pd(0.6931471805599453), x);
+    __m512d p = _mm512_set1_pd(1.0 / 362880);
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 40320));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 5040));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 720));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 120));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 24));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 6));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0 / 2));
+    p = _mm512_fmadd_pd(p, r, v_one);
+    p = _mm512_mul_pd(p, r);
+    __m512d two_k = _mm512_scalef_pd(v_one, k);
+    return _mm512_fmadd_pd(two_k, p, _mm512_sub_pd(two_k, v_one));
+}
+
+__attribute__((target("avx512f")))
+static void kernel_eval_avx512(force_params_t *param, force_ilist_t *il, double x, double y, double mass, double radius, double *fx, double *fy) {
+    const __m512d v_x = _mm512_set1_pd(x);
+    const __m512d v_y = _mm512_set1_pd(y);
+    const __m512d v_mass = _mm512_set1_pd(mass);
+    const __m512d v_rsq_min = _mm512_set1_pd(1e-6);
+    const __m512d v_falloff = _mm512_set1_pd(param->anti_gravity_falloff_rsq);
+    const __m512d v_falloff_inv = _mm512_set1_pd(param->anti_gravity_falloff_rsq_inv);
+    const __m512d v_one = _mm512_set1_pd(1.0);
+    const __m512d v_two = _mm512_set1_pd(2.0);
+    const __m512d v_three = _mm512_set1_pd(3.0);
+    __m512d v_fx = _mm512_setzero_pd();
+    __m512d v_fy = _mm512_setzero_pd();
+
+    // well-separated cells
+    int n = il->num_cells;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d dx = _mm512_sub_pd(v_x, _mm512_loadu_pd(&il->cell_x[i]));
+        __m512d dy = _mm512_sub_pd(v_y, _mm512_loadu_pd(&il->cell_y[i]));
+        __m512d dx2 = _mm512_mul_pd(dx, dx);
+        __m512d dy2 = _mm512_mul_pd(dy, dy);
+        __m512d rsq = _mm512_max_pd(_mm512_add_pd(dx2, dy2), v_rsq_min);
+        __mmask8 far = _mm512_cmp_pd_mask(rsq, v_falloff, _CMP_GT_OQ);
+        __m512d rsq_f = _mm512_mask_mul_pd(rsq, far, _mm512_mul_pd(rsq, rsq), v_falloff_inv);
+        __m512d fac = _mm512_div_pd(_mm512_mul_pd(v_mass, _mm512_loadu_pd(&il->cell_mass[i])), rsq_f);
+        v_fx = _mm512_fmadd_pd(dx, fac, v_fx);
+        v_fy = _mm512_fmadd_pd(dy, fac, v_fy);
+
+        // quadrupole correction, for cells within the falloff distance
+        __m512d a = _mm512_mul_pd(dx, _mm512_fnmadd_pd(v_three, dy2, dx2));
+        __m512d b = _mm512_mul_pd(dy, _mm512_fnmadd_pd(v_three, dx2, dy2));
+        __m512d inv = _mm512_div_pd(v_one, rsq);
+        __m512d inv3 = _mm512_maskz_mul_pd(~far, v_mass, _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv)));
+        __m512d q_xx = _mm512_loadu_pd(&il->cell_q_xx[i]);
+        __m512d q_xy2 = _mm512_mul_pd(v_two, _mm512_loadu_pd(&il->cell_q_xy[i]));
+        v_fx = _mm512_fmadd_pd(inv3, _mm512_fmsub_pd(q_xx, a, _mm512_mul_pd(q_xy2, b)), v_fx);
+        v_fy = _mm512_fnmadd_pd(inv3, _mm512_fmadd_pd(q_xx, b, _mm512_mul_pd(q_xy2, a)), v_fy);
+    }
+    kernel_cells_scalar(param, i, n, il->cell_x, il->cell_y, il->cell_mass, il->cell_q_xx, il->cell_q_xy, x, y, mass, fx, fy);
+
+    // neighbouring leaves; compute anti-gravity for all 8 and fix up any that overlap
+    n = il->num_leaves;
+    i = 0;
+    if (n >= 8) {
+        const __m512d v_cr_a = _mm512_set1_pd(param->close_repulsion_a);
+        const __m512d v_cr_b = _mm512_set1_pd(param->close_repulsion_b);
+        const __m512d v_cr_c = _mm512_set1_pd(param->close_repulsion_c);
+        const __m512d v_cr_d_r1 = _mm512_set1_pd(param->close_repulsion_d + radius);
+        const __m512d v_four = _mm512_set1_pd(4.0);
+        for (; i + 8 <= n; i += 8) {
+            __m512d dx = _mm512_sub_pd(v_x, _mm512_loadu_pd(&il->leaf_x[i]));
+            __m512d dy = _mm512_sub_pd(v_y, _mm512_loadu_pd(&il->leaf_y[i]));
+            __m512d rsq = _mm512_max_pd(_mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy)), v_rsq_min);
+            __m512d rad_sum = _mm512_add_pd(v_cr_d_r1, _mm512_loadu_pd(&il->leaf_radius[i]));
+            __m512d rad_sum_sq = _mm512_mul_pd(v_cr_c, _mm512_mul_pd(rad_sum, rad_sum));
+            __mmask8 overlap = _mm512_cmp_pd_mask(rsq, rad_sum_sq, _CMP_LT_OQ);
+            __mmask8 far = _mm512_cmp_pd_mask(rsq, v_falloff, _CMP_GT_OQ);
+            __m512d rsq_f = _mm512_mask_mul_pd(rsq, far, _mm512_mul_pd(rsq, rsq), v_falloff_inv);
+            __m512d m1m2 = _mm512_mul_pd(v_mass, _mm512_loadu_pd(&il->leaf_mass[i]));
+            __m512d fac = _mm512_div_pd(m1m2, rsq_f);
+            if (overlap && param->fast_close_repulsion) {
+                __m512d e = avx512_fast_expm1(_mm512_mul_pd(v_four, _mm512_sub_pd(rad_sum_sq, rsq)));
+                __m512d fac_cr = _mm512_div_pd(_mm512_mul_pd(v_cr_a, _mm512_min_pd(e, v_cr_b)), rsq);
+                fac_cr = _mm512_add_pd(fac_cr, _mm512_div_pd(m1m2, rad_sum_sq));
+                fac = _mm512_mask_mov_pd(fac, overlap, fac_cr);
+            } else if (overlap) {
+                double fac_lane[8];
+                _mm512_storeu_pd(fac_lane, fac);
+                for (int j = 0; j < 8; j++) {
+                    if (overlap & (1 << j)) {
+                        double ddx = x - il->leaf_x[i + j];
+                        double ddy = y - il->leaf_y[i + j];
+                        fac_lane[j] = force_kernel_close_repulsion_fac(param, mass * il->leaf_mass[i + j], radius, il->leaf_radius[i + j], fmax(ddx * ddx + ddy * ddy, 1e-6));
+                    }
+                }
+                fac = _mm512_loadu_pd(fac_lane);
+            }
+            v_fx = _mm512_fmadd_pd(dx, fac, v_fx);
+            v_fy = _mm512_fmadd_pd(dy, fac, v_fy);
+        }
+    }
+    kernel_leaves_scalar(param, i, n, il->leaf_x, il->leaf_y, il->leaf_mass, il->leaf_radius, x, y, mass, radius, fx, fy);
+
+    *fx += _mm512_reduce_add_pd(v_fx);
+    *fy += _mm512_reduce_add_pd(v_fy);
+}
+
+/******************************************************************************/
+// mutual kernels, for the close repulsion between the leaves in the list of
+// an ilist, each pair done once for both; the first num_own leaves are those
+// whose pairs with all later leaves are done, and the forces on all the
+// leaves are added to fx and fy
+
+static void kernel_mutual_scalar(force_params_t *param, force_ilist_t *il, int num_own, double *fx, double *fy) {
+    const double *lx = il->leaf_x;
+    const double *ly = il->leaf_y;
+    const double *lm = il->leaf_mass;
+    const double *lr = il->leaf_radius;
+    for (int i = 0; i < num_own; i++) {
+        double fxi = 0;
+        double fyi = 0;
+        for (int j = i + 1; j < il->num_leaves; j++) {
+            double dx = lx[i] - lx[j];
+            double dy = ly[i] - ly[j];
+            double rsq = fmax(dx * dx + dy * dy, 1e-6);
+            double fac = force_kernel_close_repulsion_fac(param, lm[i] * lm[j], lr[i], lr[j], rsq);
+            fxi += dx * fac;
+            fyi += dy * fac;
+            fx[j] -= dx * fac;
+            fy[j] -= dy * fac;
+        }
+        fx[i] += fxi;
+        fy[i] += fyi;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_mutual_avx2(force_params_t *param, force_ilist_t *il, int num_own, double *fx, double *fy) {
+    static const int64_t lane_masks[8] = {-1, -1, -1, -1, 0, 0, 0, 0};
+    const double *lx = il->leaf_x;
+    const double *ly = il->leaf_y;
+    const double *lm = il->leaf_mass;
+    const double *lr = il->leaf_radius;
+    const int n = il->num_leaves;
+    const __m256d v_rsq_min = _mm256_set1_pd(1e-6);
+    const __m256d v_falloff = _mm256_set1_pd(param->anti_gravity_falloff_rsq);
+    const __m256d v_falloff_inv = _mm256_set1_pd(param->anti_gravity_falloff_rsq_inv);
+    const __m256d v_cr_a = _mm256_set1_pd(param->close_repulsion_a);
+    const __m256d v_cr_b = _mm256_set1_pd(param->close_repulsion_b);
+    const __m256d v_cr_c = _mm256_set1_pd(param->close_repulsion_c);
+    const __m256d v_four = _mm256_set1_pd(4.0);
+    for (int i = 0; i < num_own; i++) {
+        const __m256d v_x = _mm256_set1_pd(lx[i]);
+        const __m256d v_y = _mm256_set1_pd(ly[i]);
+        const __m256d v_mass = _mm256_set1_pd(lm[i]);
+        const __m256d v_cr_d_r1 = _mm256_set1_pd(param->close_repulsion_d + lr[i]);
+        __m256d v_fx = _mm256_setzero_pd();
+        __m256d v_fy = _mm256_setzero_pd();
+        for (int j = i + 1; j < n; j += 4) {
+            // lanes past the end are loaded as 0 and masked out
+            int num_lanes = n - j < 4 ? n - j : 4;
+            __m256i lanes = _mm256_loadu_si256((const __m256i*)&lane_masks[4 - num_lanes]);
+            __m256d dx = _mm256_sub_pd(v_x, _mm256_maskload_pd(&lx[j], lanes));
+            __m256d dy = _mm256_sub_pd(v_y, _mm256_maskload_pd(&ly[j], lanes));
+            __m256d rsq = _mm256_max_pd(_mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy)), v_rsq_min);
+            __m256d rad_sum = _mm256_add_pd(v_cr_d_r1, _mm256_maskload_pd(&lr[j], lanes));
+            __m256d rad_sum_sq = _mm256_mul_pd(v_cr_c, _mm256_mul_pd(rad_sum, rad_sum));
+            __m256d overlap_mask = _mm256_and_pd(_mm256_cmp_pd(rsq, rad_sum_sq, _CMP_LT_OQ), _mm256_castsi256_pd(lanes));
+            int overlap = _mm256_movemask_pd(overlap_mask);
+            __m256d far = _mm256_cmp_pd(rsq, v_falloff, _CMP_GT_OQ);
+            __m256d rsq_f = _mm256_blendv_pd(rsq, _mm256_mul_pd(_mm256_mul_pd(rsq, rsq), v_falloff_inv), far);
+            __m256d m1m2 = _mm256_mul_pd(v_mass, _mm256_maskload_pd(&lm[j], lanes));
+            __m256d fac = _mm256_div_pd(m1m2, rsq_f);
+            if (overlap && param->fast_close_repulsion) {
+                __m256d e = avx2_fast_expm1(_mm256_mul_pd(v_four, _mm256_sub_pd(rad_sum_sq, rsq)));
+                __m256d fac_cr = _mm256_div_pd(_mm256_mul_pd(v_cr_a, _mm256_min_pd(e, v_cr_b)), rsq);
+                fac_cr = _mm256_add_pd(fac_cr, _mm256_div_pd(m1m2, rad_sum_sq));
+                fac = _mm256_blendv_pd(fac, fac_cr, overlap_mask);
+            } else if (overlap) {
+                double fac_lane[4];
+                _mm256_storeu_pd(fac_lane, fac);
+                for (int k = 0; k < num_lanes; k++) {
+                    if (overlap & (1 << k)) {
+                        double ddx = lx[i] - lx[j + k];
+                        double ddy = ly[i] - ly[j + k];
+                        fac_lane[k] = force_kernel_close_repulsion_fac(param, lm[i] * lm[j + k], lr[i], lr[j + k], fmax(ddx * ddx + ddy * ddy, 1e-6));
+                    }
+                }
+                fac = _mm256_loadu_pd(fac_lane);
+            }
+            fac = _mm256_and_pd(fac, _mm256_castsi256_pd(lanes));
+            __m256d fx_j = _mm256_mul_pd(dx, fac);
+            __m256d fy_j = _mm256_mul_pd(dy, fac);
+            v_fx = _mm256_add_pd(v_fx, fx_j);
+            v_fy = _mm256_add_pd(v_fy, fy_j);
+            _mm256_maskstore_pd(&fx[j], lanes, _mm256_sub_pd(_mm256_maskload_pd(&fx[j], lanes), fx_j));
+            _mm256_maskstore_pd(&fy[j], lanes, _mm256_sub_pd(_mm256_maskload_pd(&fy[j], lanes), fy_j));
+        }
+        fx[i] += avx2_hsum(v_fx);
+        fy[i] += avx2_hsum(v_fy);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void kernel_mutual_avx512(force_params_t *param, force_ilist_t *il, int num_own, double *fx, double *fy) {
+    const double *lx = il->leaf_x;
+    const double *ly = il->leaf_y;
+    const double *lm = il->leaf_mass;
+    const double *lr = il->leaf_radius;
+    const int n = il->num_leaves;
+    const __m512d v_rsq_min = _mm512_set1_pd(1e-6);
+    const __m512d v_falloff = _mm512_set1_pd(param->anti_gravity_falloff_rsq);
+    const __m512d v_falloff_inv = _mm512_set1_pd(param->anti_gravity_falloff_rsq_inv);
+    const __m512d v_cr_a = _mm512_set1_pd(param->close_repulsion_a);
+    const __m512d v_cr_b = _mm512_set1_pd(param->close_repulsion_b);
+    const __m512d v_cr_c = _mm512_set1_pd(param->close_repulsion_c);
+    const __m512d v_four = _mm512_set1_pd(4.0);
+    for (int i = 0; i < num_own; i++) {
+        const __m512d v_x = _mm512_set1_pd(lx[i]);
+        const __m512d v_y = _mm512_set1_pd(ly[i]);
+        const __m512d v_mass = _mm512_set1_pd(lm[i]);
+        const __m512d v_cr_d_r1 = _mm512_set1_pd(param->close_repulsion_d + lr[i]);
+        __m512d v_fx = _mm512_setzero_pd();
+        __m512d v_fy = _mm512_setzero_pd();
+        for (int j = i + 1; j < n; j += 8) {
+            int num_lanes = n - j < 8 ? n - j : 8;
+            __mmask8 lanes = (1 << num_lanes) - 1;
+            __m512d dx = _mm512_sub_pd(v_x, _mm512_maskz_loadu_pd(lanes, &lx[j]));
+            __m512d dy = _mm512_sub_pd(v_y, _mm512_maskz_loadu_pd(lanes, &ly[j]));
+            __m512d rsq = _mm512_max_pd(_mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy)), v_rsq_min);
+            __m512d rad_sum = _mm512_add_pd(v_cr_d_r1, _mm512_maskz_loadu_pd(lanes, &lr[j]));
+            __m512d rad_sum_sq = _mm512_mul_pd(v_cr_c, _mm512_mul_pd(rad_sum, rad_sum));
+            __mmask8 overlap = _mm512_mask_cmp_pd_mask(lanes, rsq, rad_sum_sq, _CMP_LT_OQ);
+            __mmask8 far = _mm512_cmp_pd_mask(rsq, v_falloff, _CMP_GT_OQ);
+            __m512d rsq_f = _mm512_mask_mul_pd(rsq, far, _mm512_mul_pd(rsq, rsq), v_falloff_inv);
+            __m512d m1m2 = _mm512_mul_pd(v_mass, _mm512_maskz_loadu_pd(lanes, &lm[j]));
+            __m512d fac = _mm512_maskz_div_pd(lanes, m1m2, rsq_f);
+            if (overlap && param->fast_close_repulsion) {
+                __m512d e = avx512_fast_expm1(_mm512_mul_pd(v_four, _mm512_sub_pd(rad_sum_sq, rsq)));
+                __m512d fac_cr = _mm512_div_pd(_mm512_mul_pd(v_cr_a, _mm512_min_pd(e, v_cr_b)), rsq);
+                fac_cr = _mm512_add_pd(fac_cr, _mm512_div_pd(m1m2, rad_sum_sq));
+                fac = _mm512_mask_mov_pd(fac, overlap, fac_cr);
+            } else if (overlap) {
+                double fac_lane[8];
+                _mm512_storeu_pd(fac_lane, fac);
+                for (int k = 0; k < num_lanes; k++) {
+                    if (overlap & (1 << k)) {
+                        double ddx = lx[i] - lx[j + k];
+                        double ddy = ly[i] - ly[j + k];
+                        fac_lane[k] = force_kernel_close_repulsion_fac(param, lm[i] * lm[j + k], lr[i], lr[j + k], fmax(ddx * ddx + ddy * ddy, 1e-6));
+                    }
+                }
+                fac = _mm512_loadu_pd(fac_lane);
+            }
+            __m512d fx_j = _mm512_mul_pd(dx, fac);
+            __m512d fy_j = _mm512_mul_pd(dy, fac);
+            v_fx = _mm512_add_pd(v_fx, fx_j);
+            v_fy = _mm512_add_pd(v_fy, fy_j);
+            _mm512_mask_storeu_pd(&fx[j], lanes, _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, &fx[j]), fx_j));
+            _mm512_mask_storeu_pd(&fy[j], lanes, _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, &fy[j]), fy_j));
+        }
+        fx[i] += _mm512_reduce_add_pd(v_fx);
+        fy[i] += _mm512_reduce_add_pd(v_fy);
+    }
+}
+
+/******************************************************************************/
+// spring kernels for the links of a node, gathering the positions of the
+// nodes at the other ends by index
+
+// distance between the positions of consecutive layout-nodes, in floats
+#define LINK_NODE_STRIDE ((int)(sizeof(layout_node_t) / sizeof(float)))
+
+static void kernel_links_scalar(const layout_t *layout, int k, int hi, float x, float y, float *fx_inout, float *fy_inout) {
+    const layout_node_t *nodes = layout->nodes;
+    const layout_edges_t *edges = &layout->edges;
+    float fx = 0;
+    float fy = 0;
+    for (; k < hi; k++) {
+        float dx = x - nodes[edges->node[k]].x;
+        float dy = y - nodes[edges->node[k]].y;
+        float r = sqrtf(dx * dx + dy * dy);
+        if (r > 1e-2f) {
+            float fac = edges->stiffness[k] * (r - edges->rest_len[k]) / r;
+            fx -= dx * fac;
+            fy -= dy * fac;
+        }
+    }
+    *fx_inout += fx;
+    *fy_inout += fy;
+}
+
+__attribute__((target("avx2,fma")))
+static inline float avx2_hsum_ps(__m256 v) {
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    return _mm_cvtss_f32(_mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_links_avx2(const layout_t *layout, int lo, int hi, float x, float y, float *fx, float *fy) {
+    const float *base_x = &layout->nodes[0].x;
+    const float *base_y = &layout->nodes[0].y;
+    const layout_edges_t *edges = &layout->edges;
+    const __m256i v_stride = _mm256_set1_epi32(LINK_NODE_STRIDE);
+    const __m256 v_x = _mm256_set1_ps(x);
+    const __m256 v_y = _mm256_set1_ps(y);
+    const __m256 v_r_min = _mm256_set1_ps(1e-2f);
+    __m256 v_fx = _mm256_setzero_ps();
+    __m256 v_fy = _mm256_setzero_ps();
+    int k = lo;
+    for (; k + 8 <= hi; k += 8) {
+        __m256i idx = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)&edges->node[k]), v_stride);
+        __m256 dx = _mm256_sub_ps(v_x, _mm256_i32gather_ps(base_x, idx, 4));
+        __m256 dy = _mm256_sub_ps(v_y, _mm256_i32gather_ps(base_y, idx, 4));
+        __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)));
+        __m256 stretch = _mm256_sub_ps(r, _mm256_loadu_ps(&edges->rest_len[k]));
+        __m256 fac = _mm256_div_ps(_mm256_mul_ps(_mm256_loadu_ps(&edges->stiffness[k]), stretch), r);
+        fac = _mm256_and_ps(fac, _mm256_cmp_ps(r, v_r_min, _CMP_GT_OQ));
+        v_fx = _mm256_fnmadd_ps(dx, fac, v_fx);
+        v_fy = _mm256_fnmadd_ps(dy, fac, v_fy);
+    }
+    kernel_links_scalar(layout, k, hi, x, y, fx, fy);
+    *fx += avx2_hsum_ps(v_fx);
+    *fy += avx2_hsum_ps(v_fy);
+}
+
+__attribute__((target("avx512f")))
+static void kernel_links_avx512(const layout_t *layout, int lo, int hi, float x, float y, float *fx, float *fy) {
+    const float *base_x = &layout->nodes[0].x;
+    const float *base_y = &layout->nodes[0].y;
+    const layout_edges_t *edges = &layout->edges;
+    const __m512i v_stride = _mm512_set1_epi32(LINK_NODE_STRIDE);
+    const __m512 v_x = _mm512_set1_ps(x);
+    const __m512 v_y = _mm512_set1_ps(y);
+    const __m512 v_r_min = _mm512_set1_ps(1e-2f);
+    __m512 v_fx = _mm512_setzero_ps();
+    __m512 v_fy = _mm512_setzero_ps();
+    int k = lo;
+    for (; k + 16 <= hi; k += 16) {
+        __m512i idx = _mm512_mullo_epi32(_mm512_loadu_si512(&edges->node[k]), v_stride);
+        __m512 dx = _mm512_sub_ps(v_x, _mm512_i32gather_ps(idx, base_x, 4));
+        __m512 dy = _mm512_sub_ps(v_y, _mm512_i32gather_ps(idx, base_y, 4));
+        __m512 r = _mm512_sqrt_ps(_mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy)));
+        __mmask16 apart = _mm512_cmp_ps_mask(r, v_r_min, _CMP_GT_OQ);
+        __m512 stretch = _mm512_sub_ps(r, _mm512_loadu_ps(&edges->rest_len[k]));
+        __m512 fac = _mm512_maskz_div_ps(apart, _mm512_mul_ps(_mm512_loadu_ps(&edges->stiffness[k]), stretch), r);
+        v_fx = _mm512_fnmadd_ps(dx, fac, v_fx);
+        v_fy = _mm512_fnmadd_ps(dy, fac, v_fy);
+    }
+    kernel_links_scalar(layout, k, hi, x, y, fx, fy);
+    *fx += _mm512_reduce_add_ps(v_fx);
+    *fy += _mm512_reduce_add_ps(v_fy);
+}
+
+/******************************************************************************/
+// selection of the kernel based on what the CPU supports
+
+typedef void (*kernel_eval_fun_t)(force_params_t *param, force_ilist_t *il, double x, double y, double mass, double radius, double *fx, double *fy);
+typedef void (*kernel_mutual_fun_t)(force_params_t *param, force_ilist_t *il, int num_own, double *fx, double *fy);
+typedef void (*kernel_links_fun_t)(const layout_t *layout, int lo, int hi, float x, float y, float *fx, float *fy);
+
+static kernel_eval_fun_t kernel_eval = NULL;
+static kernel_mutual_fun_t kernel_mutual = NULL;
+static kernel_links_fun_t kernel_links = NULL;
+static const char *kernel_name = NULL;
+
+static void kernel_select(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel_eval = kernel_eval_avx512;
+        kernel_mutual = kernel_mutual_avx512;
+        kernel_links = kernel_links_avx512;
+        kernel_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel_eval = kernel_eval_avx2;
+        kernel_mutual = kernel_mutual_avx2;
+        kernel_links = kernel_links_avx2;
+        kernel_name = "avx2";
+    } else {
+        kernel_eval = kernel_eval_scalar;
+        kernel_mutual = kernel_mutual_scalar;
+        kernel_links = kernel_links_scalar;
+        kernel_name = "scalar";
+    }
+}
+
+const char *force_kernel_name(void) {
+    if (kernel_eval == NULL) {
+        kernel_select();
+    }
+    return kernel_name;
+}
+
+void force_kernel_eval(force_params_t *param, force_ilist_t *il, double x, double y, double mass, double radius, double *fx_out, double *fy_out) {
+    if (kernel_eval == NULL) {
+        kernel_select();
+    }
+    double fx = 0;
+    double fy = 0;
+    kernel_eval(param, il, x, y, mass, radius, &fx, &fy);
+    *fx_out = fx;
+    *fy_out = fy;
+}
+
+void force_kernel_mutual(force_params_t *param, force_ilist_t *il, int num_own, double *fx, double *fy) {
+    if (kernel_mutual == NULL) {
+        kernel_select();
+    }
+    kernel_mutual(param, il, num_own, fx, fy);
+}
+
+double force_kernel_check_fast_close_repulsion(force_params_t *param) {
+    force_params_t fast = *param;
+    force_params_t exact = *param;
+    fast.fast_close_repulsion = true;
+    exact.fast_close_repulsion = false;
+
+    // a leaf at the origin against 16 copies of another, so that the vector
+    // loops of the kernel are used, at distances spanning the overlap
+    static const double radii[] = {0.1, 0.5, 1, 2, 5, 10, 30};
+    const int num_radii = sizeof(radii) / sizeof(radii[0]);
+    const int num_steps = 1000;
+    force_ilist_t il;
+    force_ilist_init(&il);
+    double max_rel_err = 0;
+    for (int j1 = 0; j1 < num_radii; j1++) {
+        for (int j2 = 0; j2 < num_radii; j2++) {
+            double rad_sum = param->close_repulsion_d + radii[j1] + radii[j2];
+            double dist_max = sqrt(param->close_repulsion_c) * rad_sum;
+            for (int s = 0; s < num_steps; s++) {
+                double dist = dist_max * s / num_steps;
+                force_ilist_reset(&il);
+                for (int k = 0; k < 16; k++) {
+                    force_ilist_add_leaf(&il, -dist, 0, 2, radii[j2]);
+                }
+                double fx_fast, fy_fast, fx_exact, fy_exact;
+                force_kernel_eval(&fast, &il, 0, 0, 3, radii[j1], &fx_fast, &fy_fast);
+                force_kernel_eval(&exact, &il, 0, 0, 3, radii[j1], &fx_exact, &fy_exact);
+                if (fx_exact != 0) {
+                    max_rel_err = fmax(max_rel_err, fabs(fx_fast - fx_exact) / fabs(fx_exact));
+                }
+            }
+        }
+    }
+    m_free(il.leaf_x);
+    m_free(il.leaf_y);
+    m_free(il.leaf_mass);
+    m_free(il.leaf_radius);
+    m_free(il.leaf_fx);
+    m_free(il.leaf_fy);
+
+    printf("fast close repulsion with %s kernel: maximum relative error %.3e\n", force_kernel_name(), max_rel_err);
+    if (max_rel_err > FORCE_KERNEL_FAST_EXPM1_MAX_REL_ERR) {
+        printf("ERROR: fast close repulsion is less accurate than %.1e\n", FORCE_KERNEL_FAST_EXPM1_MAX_REL_ERR);
+    }
+    return max_rel_err;
+}
+
+void force_kernel_links(const layout_t *layout, int lo, int hi, float x, float y, float *fx_out, float *fy_out) {
+    if (kernel_links == NULL) {
+        kernel_select();
+    }
+    float fx = 0;
+    float fy = 0;
+    kernel_links(layout, lo, hi, x, y, &fx, &fy);
+    *fx_out = fx;
+    *fy_out = fy;
+}
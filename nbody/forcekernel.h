@@ -0,0 +1,130 @@
+#ifndef _INCLUDED_FORCEKERNEL_H
+#define _INCLUDED_FORCEKERNEL_H
+
+#include <stdint.h>
+#include <math.h>
+
+#include "force.h"
+
+// the interactions of a single leaf with the rest of the quad tree, stored as
+// flat arrays so that they can be evaluated by a vectorised kernel
+typedef struct _force_ilist_t {
+    // well-separated cells (and leaves, when not doing close repulsion)
+    int num_cells;
+    int cells_alloc;
+    double *cell_x;
+    double *cell_y;
+    double *cell_mass;
+    double *cell_q_xx;
+    double *cell_q_xy;
+
+    // neighbouring leaves, which may overlap and need close repulsion
+    int num_leaves;
+    int leaves_alloc;
+    double *leaf_x;
+    double *leaf_y;
+    double *leaf_mass;
+    double *leaf_radius;
+    double *leaf_fx;    // forces on the leaves, only for force_kernel_mutual
+    double *leaf_fy;
+} force_ilist_t;
+
+void force_ilist_init(force_ilist_t *il);
+void force_ilist_reset(force_ilist_t *il);
+void force_ilist_grow_cells(force_ilist_t *il);
+void force_ilist_grow_leaves(force_ilist_t *il);
+
+static inline void force_ilist_add_cell(force_ilist_t *il, double x, double y, double mass, double q_xx, double q_xy) {
+    if (il->num_cells >= il->cells_alloc) {
+        force_ilist_grow_cells(il);
+    }
+    il->cell_x[il->num_cells] = x;
+    il->cell_y[il->num_cells] = y;
+    il->cell_mass[il->num_cells] = mass;
+    il->cell_q_xx[il->num_cells] = q_xx;
+    il->cell_q_xy[il->num_cells] = q_xy;
+    il->num_cells += 1;
+}
+
+static inline void force_ilist_add_leaf(force_ilist_t *il, double x, double y, double mass, double radius) {
+    if (il->num_leaves >= il->leaves_alloc) {
+        force_ilist_grow_leaves(il);
+    }
+    il->leaf_x[il->num_leaves] = x;
+    il->leaf_y[il->num_leaves] = y;
+    il->leaf_mass[il->num_leaves] = mass;
+    il->leaf_radius[il->num_leaves] = radius;
+    il->num_leaves += 1;
+}
+
+// anti-gravity force factor between two masses, rsq already has the minimum distance cut-off applied
+static inline double force_kernel_anti_gravity_fac(force_params_t *param, double m1m2, double rsq) {
+    if (rsq > param->anti_gravity_falloff_rsq) { rsq *= rsq * param->anti_gravity_falloff_rsq_inv; }
+    return m1m2 / rsq;
+}
+
+// the fast close repulsion computes exp(x) - 1 with at most this relative
+// error, for x up to FORCE_KERNEL_FAST_EXPM1_MAX_X; larger x are clamped,
+// which is harmless as long as close_repulsion_b < exp(700)
+#define FORCE_KERNEL_FAST_EXPM1_MAX_REL_ERR (1e-10)
+#define FORCE_KERNEL_FAST_EXPM1_MAX_X (700.0)
+
+// exp(x) - 1 for 0 <= x <= FORCE_KERNEL_FAST_EXPM1_MAX_X, as 2^k (exp(r) - 1) + 2^k - 1
+// with x = k ln2 + r and |r| <= ln2 / 2, where exp(r) - 1 is a degree 9 polynomial
+static inline double force_kernel_fast_expm1(double x) {
+    x = fmin(x, FORCE_KERNEL_FAST_EXPM1_MAX_X);
+    double k = rint(x * 1.4426950408889634);
+    double r = x - k * 0.6931471805599453;
+    double p = r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120
+        + r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 + r * (1.0 / 362880)))))))));
+    union { uint64_t i; double d; } two_k = { (uint64_t)((int64_t)k + 1023) << 52 };
+    return two_k.d * p + (two_k.d - 1.0);
+}
+
+// force factor between two leaves when doing close repulsion
+static inline double force_kernel_close_repulsion_fac(force_params_t *param, double m1m2, double r1, double r2, double rsq) {
+    double rad_sum = param->close_repulsion_d + r1 + r2;
+    double rad_sum_sq = param->close_repulsion_c * rad_sum * rad_sum;
+    if (rsq < rad_sum_sq) {
+        // layout-nodes overlap, use stronger repulsive force
+        double e = param->fast_close_repulsion ? force_kernel_fast_expm1(4.0 * (rad_sum_sq - rsq)) : exp(4.0 * (rad_sum_sq - rsq)) - 1.0;
+        return param->close_repulsion_a * fmin(param->close_repulsion_b, e) / rsq
+            + m1m2 / rad_sum_sq;
+    } else {
+        // normal anti-gravity repulsive force
+        return force_kernel_anti_gravity_fac(param, m1m2, rsq);
+    }
+}
+
+// returns the name of the kernel in use: "avx512", "avx2" or "scalar"
+const char *force_kernel_name(void);
+
+// quadrupole correction to the force of a cell, which is m * conj(M_2 / w^3) in
+// complex notation, with M_2 = q_xx + 2i q_xy and w = dx + i dy; only valid
+// within the falloff distance, where the force is harmonic
+static inline void force_kernel_quadrupole(double mass, double q_xx, double q_xy, double dx, double dy, double rsq, double *fx, double *fy) {
+    double a = dx * (dx * dx - 3.0 * dy * dy);
+    double b = dy * (dy * dy - 3.0 * dx * dx);
+    double inv = 1.0 / rsq;
+    double fac = mass * inv * inv * inv;
+    *fx += fac * (q_xx * a - 2.0 * q_xy * b);
+    *fy -= fac * (q_xx * b + 2.0 * q_xy * a);
+}
+
+// computes the force on a leaf (at x, y with given mass and radius) due to everything in the list
+void force_kernel_eval(force_params_t *param, force_ilist_t *il, double x, double y, double mass, double radius, double *fx_out, double *fy_out);
+
+// computes the force between each of the first num_own leaves in the list and
+// all the leaves after it, once for each pair, adding the force on leaf k to
+// fx[k], fy[k]; used for the pairs of leaves that are done for both at once
+void force_kernel_mutual(force_params_t *param, force_ilist_t *il, int num_own, double *fx, double *fy);
+
+// compares the close repulsion of the kernel in use, with fast_close_repulsion
+// on, to the exact formula over the whole range of overlap; prints and returns
+// the maximum relative error of the force
+double force_kernel_check_fast_close_repulsion(force_params_t *param);
+
+// computes the spring force on a node at (x, y) due to the links [lo, hi) of layout->edges
+void force_kernel_links(const layout_t *layout, int lo, int hi, float x, float y, float *fx_out, float *fy_out);
+
+#endif // _INCLUDED_FORCEKERNEL_H
@@ -0,0 +1,274 @@
+// The Barnes-Hut tree walk, included by force.c once for each combination of
+// the flags below, so that they are constants in the walk and its inner loops.
+// There is no include guard, on purpose.
+//
+//   FORCE_WALK_CLOSE_REPULSION  1 if items in neighbouring leaves are done
+//                               with close repulsion, 0 for anti-gravity only
+//   FORCE_WALK_NOT_HELD         1 to skip the items whose layout-nodes are
+//                               held still, 0 to compute the force on all
+//   FORCE_WALK(name)            name of a function of this variant
+//
+// The flags and FORCE_WALK are undefined at the end of this file.
+
+// add the items in the range [lo, hi) of a leaf, except for the one at position skip
+static void FORCE_WALK(quad_tree_forces_add_items)(force_ilist_t *il, quadtree_t *qt, int lo, int hi, int skip) {
+    for (int i = lo; i < hi; i++) {
+        if (i == skip) {
+            continue;
+        }
+#if FORCE_WALK_CLOSE_REPULSION
+        // layout-nodes may overlap, so we need the radius
+        force_ilist_add_leaf(il, qt->item_x[i], qt->item_y[i], qt->item_mass[i], qt->item_radius[i]);
+#else
+        // normal anti-gravity repulsive force, same as for a cell
+        force_ilist_add_cell(il, qt->item_x[i], qt->item_y[i], qt->item_mass[i], 0, 0);
+#endif
+    }
+}
+
+// the item at (x, y) is what we check q2 against
+// the interactions are collected in il, to be evaluated all at once by the force kernel
+static void FORCE_WALK(quad_tree_forces_item_vs_node)(force_params_t *param, force_ilist_t *il, quadtree_t *qt, double x, double y, int q2) {
+    if (quadtree_is_leaf(qt, q2) && (FORCE_WALK_CLOSE_REPULSION || qt->num_items[q2] == 1)) {
+        // q2 is leaf node whose items are always done directly
+        FORCE_WALK(quad_tree_forces_add_items)(il, qt, qt->first[q2], qt->first[q2] + qt->num_items[q2], -1);
+        return;
+    }
+
+    // compute distance from the item to centroid of q2
+    double dx = x - qt->x[q2];
+    double dy = y - qt->y[q2];
+    double rsq = dx * dx + dy * dy;
+
+    if (qt->side_length[q2] * qt->side_length[q2] < param->barnes_hut_opening * rsq) {
+        // the item and the cell q2 are "well separated"
+        // approximate force by centroid and quadrupole moment of q2
+        force_ilist_add_cell(il, qt->x[q2], qt->y[q2], qt->mass[q2], qt->q_xx[q2], qt->q_xy[q2]);
+    } else if (quadtree_is_leaf(qt, q2)) {
+        // the item and the leaf q2 are not "well separated"
+        // use the items of q2 directly
+        FORCE_WALK(quad_tree_forces_add_items)(il, qt, qt->first[q2], qt->first[q2] + qt->num_items[q2], -1);
+    } else {
+        // the item and q2 are not "well separated"
+        // descend into children of q2
+        int c_hi = qt->first[q2] + quadtree_num_children(qt, q2);
+        for (int c = qt->first[q2]; c < c_hi; c++) {
+            FORCE_WALK(quad_tree_forces_item_vs_node)(param, il, qt, x, y, c);
+        }
+    }
+}
+
+// computes the force on the item at position i of leaf q
+static void FORCE_WALK(quad_tree_forces_ascend)(force_params_t *param, force_ilist_t *il, quadtree_t *qt, int q, int i) {
+    assert(quadtree_is_leaf(qt, q)); // must be a leaf node
+    double x = qt->item_x[i];
+    double y = qt->item_y[i];
+    force_ilist_reset(il);
+    FORCE_WALK(quad_tree_forces_add_items)(il, qt, qt->first[q], qt->first[q] + qt->num_items[q], i);
+    for (int q2 = q; qt->parent[q2] >= 0; q2 = qt->parent[q2]) {
+        int parent = qt->parent[q2];
+        assert(!quadtree_is_leaf(qt, parent)); // all parents should be internal nodes
+        int c_hi = qt->first[parent] + quadtree_num_children(qt, parent);
+        for (int c = qt->first[parent]; c < c_hi; c++) {
+            if (c != q2) {
+                FORCE_WALK(quad_tree_forces_item_vs_node)(param, il, qt, x, y, c);
+            }
+        }
+    }
+    quad_tree_forces_eval_item(param, il, qt, i);
+}
+
+// as quad_tree_forces_item_vs_node, but for all the items within extent of (x, y)
+static void FORCE_WALK(group_list_record_vs_node)(force_params_t *param, force_group_list_t *gl, quadtree_t *qt, double x, double y, double extent, int q2) {
+    if (quadtree_is_leaf(qt, q2) && (FORCE_WALK_CLOSE_REPULSION || qt->num_items[q2] == 1)) {
+        group_list_add(gl, ~q2);
+        return;
+    }
+
+    if (group_is_well_separated(param, qt, x, y, extent, q2)) {
+        group_list_add(gl, q2);
+    } else if (quadtree_is_leaf(qt, q2)) {
+        group_list_add(gl, ~q2);
+    } else {
+        int c_hi = qt->first[q2] + quadtree_num_children(qt, q2);
+        for (int c = qt->first[q2]; c < c_hi; c++) {
+            FORCE_WALK(group_list_record_vs_node)(param, gl, qt, x, y, extent, c);
+        }
+    }
+}
+
+// walk the tree for the group q, with the given margin for movement; if mutual
+// is set, q is a leaf and its mutual pairs are taken out of the list
+static void FORCE_WALK(group_list_record)(force_params_t *param, force_group_list_t *gl, quadtree_t *qt, int q, double margin, bool mutual) {
+    // the items of the group are all within extent of its centre of mass
+    double x = qt->x[q];
+    double y = qt->y[q];
+    double extent = group_extent(qt, q) + margin;
+
+    gl->age = 0;
+    gl->x = x;
+    gl->y = y;
+    gl->num = 0;
+    gl->num_pairs = 0;
+    for (int q2 = q; qt->parent[q2] >= 0; q2 = qt->parent[q2]) {
+        int parent = qt->parent[q2];
+        int k_lo = gl->num;
+        int c_hi = qt->first[parent] + quadtree_num_children(qt, parent);
+        for (int c = qt->first[parent]; c < c_hi; c++) {
+            if (c != q2) {
+                FORCE_WALK(group_list_record_vs_node)(param, gl, qt, x, y, extent, c);
+            }
+        }
+        if (mutual) {
+            group_list_take_pairs(param, gl, qt, q, q2, k_lo);
+        }
+    }
+}
+
+// computes the force on the items of group q using its recorded list
+static void FORCE_WALK(group_list_apply)(force_params_t *param, force_ilist_t *il, force_group_list_t *gl, quadtree_t *qt, int q) {
+    int i_lo = quad_tree_first_item(qt, q);
+    int i_hi = i_lo + qt->num_items[q];
+    for (int i = i_lo; i < i_hi; i++) {
+#if FORCE_WALK_NOT_HELD
+        if (quadtree_get_item(qt, i)->flags & LAYOUT_NODE_HOLD_STILL) {
+            continue;
+        }
+#endif
+        force_ilist_reset(il);
+        FORCE_WALK(quad_tree_forces_add_items)(il, qt, i_lo, i_hi, i);
+        for (int k = 0; k < gl->num; k++) {
+            int q2 = gl->list[k];
+            if (q2 < 0) {
+                q2 = ~q2;
+                FORCE_WALK(quad_tree_forces_add_items)(il, qt, qt->first[q2], qt->first[q2] + qt->num_items[q2], -1);
+            } else {
+                force_ilist_add_cell(il, qt->x[q2], qt->y[q2], qt->mass[q2], qt->q_xx[q2], qt->q_xy[q2]);
+            }
+        }
+        quad_tree_forces_eval_item(param, il, qt, i);
+    }
+}
+
+#if FORCE_WALK_CLOSE_REPULSION
+// computes the force on the items of leaf q using its recorded list, with the
+// pairs within q and with the leaves in its pairs done once for both items
+static void FORCE_WALK(group_list_apply_mutual)(force_params_t *param, force_ilist_t *il, force_group_list_t *gl, quadtree_t *qt, int q) {
+    int i_lo = qt->first[q];
+    int i_hi = i_lo + qt->num_items[q];
+
+    // the items of q, then those of its pairs
+    force_ilist_reset(il);
+    FORCE_WALK(quad_tree_forces_add_items)(il, qt, i_lo, i_hi, -1);
+    for (int k = 0; k < gl->num_pairs; k++) {
+        int b = gl->pairs[k];
+        FORCE_WALK(quad_tree_forces_add_items)(il, qt, qt->first[b], qt->first[b] + qt->num_items[b], -1);
+    }
+    for (int k = 0; k < il->num_leaves; k++) {
+        il->leaf_fx[k] = 0;
+        il->leaf_fy[k] = 0;
+    }
+    force_kernel_mutual(param, il, i_hi - i_lo, il->leaf_fx, il->leaf_fy);
+    int k = 0;
+    for (int i = i_lo; i < i_hi; i++, k++) {
+        mutual_fx[i] += il->leaf_fx[k];
+        mutual_fy[i] += il->leaf_fy[k];
+    }
+    for (int p = 0; p < gl->num_pairs; p++) {
+        int b = gl->pairs[p];
+        int j_hi = qt->first[b] + qt->num_items[b];
+        for (int j = qt->first[b]; j < j_hi; j++, k++) {
+            mutual_fx[j] += il->leaf_fx[k];
+            mutual_fy[j] += il->leaf_fy[k];
+        }
+    }
+
+    // the rest of the list is the same for all the items of q
+    force_ilist_reset(il);
+    for (int k = 0; k < gl->num; k++) {
+        int q2 = gl->list[k];
+        if (q2 < 0) {
+            q2 = ~q2;
+            FORCE_WALK(quad_tree_forces_add_items)(il, qt, qt->first[q2], qt->first[q2] + qt->num_items[q2], -1);
+        } else {
+            force_ilist_add_cell(il, qt->x[q2], qt->y[q2], qt->mass[q2], qt->q_xx[q2], qt->q_xy[q2]);
+        }
+    }
+    for (int i = i_lo; i < i_hi; i++) {
+        double fx = mutual_fx[i];
+        double fy = mutual_fy[i];
+        mutual_fx[i] = 0;
+        mutual_fy[i] = 0;
+        layout_node_t *ln = quadtree_get_item(qt, i);
+#if FORCE_WALK_NOT_HELD
+        if (ln->flags & LAYOUT_NODE_HOLD_STILL) {
+            continue;
+        }
+#endif
+        double il_fx, il_fy;
+        force_kernel_eval(param, il, qt->item_x[i], qt->item_y[i], qt->item_mass[i], qt->item_radius[i], &il_fx, &il_fy);
+        ln->fx += fx + il_fx;
+        ln->fy += fy + il_fy;
+    }
+}
+#endif
+
+// the cached list of group q, recorded again if it is out of date
+static force_group_list_t *FORCE_WALK(group_cache_get)(force_params_t *param, quadtree_t *qt, int q) {
+    force_group_list_t *gl = &group_cache[q];
+    double drift = FORCE_ILIST_CACHE_MAX_DRIFT * qt->side_length[q];
+    if (gl->generation != group_cache_generation
+        || gl->age >= FORCE_ILIST_CACHE_MAX_AGE
+        || fabs(qt->x[q] - gl->x) > drift
+        || fabs(qt->y[q] - gl->y) > drift) {
+        FORCE_WALK(group_list_record)(param, gl, qt, q, 2 * drift, false);
+        gl->generation = group_cache_generation;
+    }
+    gl->age += 1;
+    return gl;
+}
+
+// computes the force on the items of cell q, which is a group, or a leaf if
+// not grouping (or with a mutual near field); gl is for the list of a group
+// that is not cached
+static void FORCE_WALK(quad_tree_forces_group)(force_params_t *param, force_ilist_t *il, force_group_list_t *gl, quadtree_t *qt, int q) {
+#if FORCE_WALK_CLOSE_REPULSION
+    if (force_mutual_near_field(param)) {
+        FORCE_WALK(group_list_record)(param, gl, qt, q, 0, true);
+        FORCE_WALK(group_list_apply_mutual)(param, il, gl, qt, q);
+        return;
+    }
+#endif
+    if (param->cache_ilists) {
+        FORCE_WALK(group_list_apply)(param, il, FORCE_WALK(group_cache_get)(param, qt, q), qt, q);
+    } else if (param->barnes_hut_group_size > 0) {
+        FORCE_WALK(group_list_record)(param, gl, qt, q, 0, false);
+        FORCE_WALK(group_list_apply)(param, il, gl, qt, q);
+    } else {
+        int i_hi = qt->first[q] + qt->num_items[q];
+        for (int i = qt->first[q]; i < i_hi; i++) {
+#if FORCE_WALK_NOT_HELD
+            if (quadtree_get_item(qt, i)->flags & LAYOUT_NODE_HOLD_STILL) {
+                continue;
+            }
+#endif
+            FORCE_WALK(quad_tree_forces_ascend)(param, il, qt, q, i);
+        }
+    }
+}
+
+static void FORCE_WALK(quad_tree_forces_descend)(force_params_t *param, force_ilist_t *il, force_group_list_t *gl, quadtree_t *qt, int q) {
+    // with a mutual near field the groups are the leaves
+    if (quadtree_is_leaf(qt, q) || (qt->num_items[q] <= param->barnes_hut_group_size && !force_mutual_near_field(param))) {
+        FORCE_WALK(quad_tree_forces_group)(param, il, gl, qt, q);
+    } else {
+        int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+        for (int c = qt->first[q]; c < c_hi; c++) {
+            FORCE_WALK(quad_tree_forces_descend)(param, il, gl, qt, c);
+        }
+    }
+}
+
+#undef FORCE_WALK_CLOSE_REPULSION
+#undef FORCE_WALK_NOT_HELD
+#undef FORCE_WALK
@@ -16,6 +16,7 @@
 #include "mapmysql.h"
 #include "mapcairo.h"
 #include "cairohelper.h"
+#include "threadpool.h"
 
 vstr_t *vstr;
 GtkWidget *window;
@@ -548,6 +549,7 @@ static int usage(const char *progname) {
     printf("    --no-fake-links, -nf      don't create fake links\n");
     printf("    --link <num>              link strength\n");
     printf("    --rsq <num>               r-star squared distance for anti-gravity\n");
+    printf("    --threads, -t <num>       number of threads to use (default is number of cores)\n");
     printf("\n");
     return 1;
 }
@@ -563,6 +565,7 @@ int main(int argc, char *argv[]) {
     const char *arg_cats_json   = "../config/arxiv-categories.json";
     const char *arg_layout_json = NULL;
     const char *arg_refs_json   = NULL;
+    int arg_num_threads         = 0;
     for (int a = 1; a < argc; a++) {
         if (streq(argv[a], "--settings") || streq(argv[a], "-s")) {
             a += 1;
@@ -604,11 +607,20 @@ int main(int argc, char *argv[]) {
             arg_refs_json = argv[a];
         } else if (streq(argv[a], "--no-fake-links") || streq(argv[a], "-nf")) {
             arg_no_fake_links = true;
+        } else if (streq(argv[a], "--threads") || streq(argv[a], "-t")) {
+            a += 1;
+            if (a >= argc) {
+                return usage(argv[0]);
+            }
+            arg_num_threads = strtol(argv[a], NULL, 10);
         } else {
             return usage(argv[0]);
         }
     }
 
+    // start the worker threads
+    threadpool_init(arg_num_threads);
+
     // load settings from json file
     init_config_t *init_config;
     if (!init_config_new(arg_settings,&init_config)) {
@@ -12,6 +12,7 @@
 #include "mapauto.h"
 #include "mysql.h"
 #include "json.h"
+#include "threadpool.h"
 
 static int usage(const char *progname) {
     printf("\n");
@@ -33,6 +34,7 @@ static int usage(const char *progname) {
     printf("    --rsq <num>               r-star squared distance for anti-gravity\n");
     printf("    --factor-ref-link <num>   factor to use for reference links (default 1)\n");
     printf("    --factor-other-link <num> factor to use for other links (default 0)\n");
+    printf("    --threads, -t <num>       number of threads to use (default is number of cores)\n");
     printf("\n");
     return 1;
 }
@@ -54,6 +56,7 @@ int main(int argc, char *argv[]) {
     const char *arg_other_links  = NULL;
     double arg_factor_ref_link   = 1;
     double arg_factor_other_link = 0;
+    int arg_num_threads          = 0;
     for (int a = 1; a < argc; a++) {
         if (streq(argv[a], "--settings") || streq(argv[a], "-s")) {
             a += 1;
@@ -115,11 +118,19 @@ int main(int argc, char *argv[]) {
                 return usage(argv[0]);
             }
             arg_factor_other_link = strtod(argv[a], NULL);;
+        } else if (streq(argv[a], "--threads") || streq(argv[a], "-t")) {
+            if (++a >= argc) {
+                return usage(argv[0]);
+            }
+            arg_num_threads = strtol(argv[a], NULL, 10);
         } else {
             return usage(argv[0]);
         }
     }
 
+    // start the worker threads
+    threadpool_init(arg_num_threads);
+
     // load settings from json file
     init_config_t *init_config;
     if (!init_config_new(arg_settings,&init_config)) {
@@ -197,13 +208,19 @@ int main(int argc, char *argv[]) {
             map_env_layout_pos_load_from_json(map_env, arg_layout_json);
         }
 
-        // rotate the entire map by a random amount, to reduce quad-tree-force artifacts
+        // rotate the entire map by a random amount, to reduce quad-tree-force artifacts;
+        // not needed if the quad tree shifts its cells by a random amount itself
         struct timeval tp;
         gettimeofday(&tp, NULL);
         srandom(tp.tv_sec * 1000000 + tp.tv_usec);
-        double angle = 6.28 * (double)random() / (double)RAND_MAX;
-        map_env_rotate_all(map_env, angle);
-        printf("rotated graph by %.2f rad to eliminate quad-tree-force artifacts\n", angle);
+        if (!init_config->nbody.forces.quadtree_random_shift) {
+            double angle = 6.28 * (double)random() / (double)RAND_MAX;
+            map_env_rotate_all(map_env, angle);
+            printf("rotated graph by %.2f rad to eliminate quad-tree-force artifacts\n", angle);
+        }
+
+        // the layout-nodes only move a little from here on, so the quad tree can be refitted
+        map_env_set_refit_quad_tree(map_env, true);
 
         // assign positions to new papers
         int n_new = map_env_layout_place_new_papers(map_env);
@@ -54,6 +54,7 @@ bool init_config_new(const char *filename, init_config_t **config) {
     (*config)->nbody.use_external_cites = false;
     (*config)->nbody.mass_cites_exponent = 1.;
     (*config)->nbody.add_missing_cats = false;
+    (*config)->nbody.integrator = "steepest_descent";
     (*config)->nbody.forces.close_repulsion_a        = 1e9;
     (*config)->nbody.forces.close_repulsion_b        = 1e14;
     (*config)->nbody.forces.close_repulsion_c        = 1.1;
@@ -62,6 +63,18 @@ bool init_config_new(const char *filename, init_config_t **config) {
     (*config)->nbody.forces.anti_gravity_falloff_rsq = 1e6;
     (*config)->nbody.forces.use_ref_freq             = true;
     (*config)->nbody.forces.initial_close_repulsion  = false;
+    (*config)->nbody.forces.barnes_hut_opening       = 0.8;
+    (*config)->nbody.forces.barnes_hut_group_size    = 0;
+    (*config)->nbody.forces.anti_gravity_solver      = "barnes_hut";
+    (*config)->nbody.forces.fmm_order                = 6;
+    (*config)->nbody.forces.quadtree_leaf_size       = 8;
+    (*config)->nbody.forces.quadtree_random_shift    = false;
+    (*config)->nbody.forces.cache_interaction_lists  = false;
+    (*config)->nbody.forces.mutual_near_field        = false;
+    (*config)->nbody.forces.fast_close_repulsion     = false;
+    (*config)->nbody.forces.check_fast_close_repulsion = false;
+    (*config)->nbody.forces.close_repulsion_cell_list = false;
+    (*config)->nbody.forces.close_repulsion_skin     = 1.0;
     // attempt to set from JSON file
     jsmntok_t *nbody_tok;
     if(jsmn_env_get_object_member_token(&jsmn_env, jsmn_env.js_tok, "nbody", JSMN_OBJECT, &nbody_tok)) {
@@ -83,11 +96,17 @@ bool init_config_new(const char *filename, init_config_t **config) {
         if(jsmn_env_get_object_member_value_boolean(&jsmn_env, nbody_tok, "add_missing_cats", &missing_cats_val)) {
             (*config)->nbody.add_missing_cats = (missing_cats_val.kind == JSMN_VALUE_TRUE);
         }
+        // look for member: integrator
+        // ===========================
+        jsmn_env_token_value_t integrator_val;
+        if(jsmn_env_get_object_member_value(&jsmn_env, nbody_tok, "integrator", JSMN_VALUE_STRING, &integrator_val)) {
+            (*config)->nbody.integrator = strdup(integrator_val.str);
+        }
         // look for member: forces
         // =======================
         jsmntok_t *forces_tok;
         if(jsmn_env_get_object_member_token(&jsmn_env, nbody_tok, "forces", JSMN_OBJECT, &forces_tok)) {
-            jsmn_env_token_value_t do_cr_val, use_rf_val, cr_a_val, cr_b_val, cr_c_val, cr_d_val, link_val, anti_grav_val;
+            jsmn_env_token_value_t do_cr_val, use_rf_val, cr_a_val, cr_b_val, cr_c_val, cr_d_val, link_val, anti_grav_val, opening_val, group_size_val, solver_val, fmm_order_val, leaf_size_val, random_shift_val, cache_il_val, mutual_val, fast_cr_val, check_fast_cr_val, cell_list_val, skin_val;
             if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "close_repulsion_a", JSMN_VALUE_REAL, &cr_a_val)) {
                 (*config)->nbody.forces.close_repulsion_a        = cr_a_val.real;
             }
@@ -112,6 +131,42 @@ bool init_config_new(const char *filename, init_config_t **config) {
             if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "initial_close_repulsion", &do_cr_val)) {
                 (*config)->nbody.forces.initial_close_repulsion  = (do_cr_val.kind == JSMN_VALUE_TRUE);
             }
+            if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "barnes_hut_opening", JSMN_VALUE_REAL, &opening_val)) {
+                (*config)->nbody.forces.barnes_hut_opening       = opening_val.real;
+            }
+            if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "barnes_hut_group_size", JSMN_VALUE_UINT, &group_size_val)) {
+                (*config)->nbody.forces.barnes_hut_group_size    = group_size_val.uint;
+            }
+            if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "anti_gravity_solver", JSMN_VALUE_STRING, &solver_val)) {
+                (*config)->nbody.forces.anti_gravity_solver      = strdup(solver_val.str);
+            }
+            if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "fmm_order", JSMN_VALUE_UINT, &fmm_order_val)) {
+                (*config)->nbody.forces.fmm_order                = fmm_order_val.uint;
+            }
+            if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "quadtree_leaf_size", JSMN_VALUE_UINT, &leaf_size_val)) {
+                (*config)->nbody.forces.quadtree_leaf_size       = leaf_size_val.uint;
+            }
+            if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "quadtree_random_shift", &random_shift_val)) {
+                (*config)->nbody.forces.quadtree_random_shift    = (random_shift_val.kind == JSMN_VALUE_TRUE);
+            }
+            if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "cache_interaction_lists", &cache_il_val)) {
+                (*config)->nbody.forces.cache_interaction_lists  = (cache_il_val.kind == JSMN_VALUE_TRUE);
+            }
+            if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "mutual_near_field", &mutual_val)) {
+                (*config)->nbody.forces.mutual_near_field        = (mutual_val.kind == JSMN_VALUE_TRUE);
+            }
+            if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "fast_close_repulsion", &fast_cr_val)) {
+                (*config)->nbody.forces.fast_close_repulsion     = (fast_cr_val.kind == JSMN_VALUE_TRUE);
+            }
+            if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "check_fast_close_repulsion", &check_fast_cr_val)) {
+                (*config)->nbody.forces.check_fast_close_repulsion = (check_fast_cr_val.kind == JSMN_VALUE_TRUE);
+            }
+            if(jsmn_env_get_object_member_value_boolean(&jsmn_env, forces_tok, "close_repulsion_cell_list", &cell_list_val)) {
+                (*config)->nbody.forces.close_repulsion_cell_list = (cell_list_val.kind == JSMN_VALUE_TRUE);
+            }
+            if(jsmn_env_get_object_member_value(&jsmn_env, forces_tok, "close_repulsion_skin", JSMN_VALUE_REAL, &skin_val)) {
+                (*config)->nbody.forces.close_repulsion_skin     = skin_val.real;
+            }
         }
         // look for member: map_orientation
         // ================================
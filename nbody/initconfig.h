@@ -11,6 +11,7 @@ typedef struct _init_config_t {
         bool   use_external_cites;
         double mass_cites_exponent;
         bool add_missing_cats;
+        const char *integrator;
         
         struct _config_forces_t {
             bool   use_ref_freq;
@@ -21,6 +22,18 @@ typedef struct _init_config_t {
             double close_repulsion_d;
             double link_strength;
             double anti_gravity_falloff_rsq;
+            double barnes_hut_opening;
+            int    barnes_hut_group_size;
+            const char *anti_gravity_solver;
+            int    fmm_order;
+            int    quadtree_leaf_size;
+            bool   quadtree_random_shift;
+            bool   cache_interaction_lists;
+            bool   mutual_near_field;
+            bool   fast_close_repulsion;
+            bool   check_fast_close_repulsion;
+            bool   close_repulsion_cell_list;
+            double close_repulsion_skin;
         } forces;
 
         struct _config_map_orientation_t {
@@ -7,31 +7,267 @@
 #include "util/xiwilib.h"
 #include "common.h"
 #include "layout.h"
+#include "threadpool.h"
+
+static void layout_edges_init(layout_edges_t *edges) {
+    edges->valid = false;
+    edges->start = NULL;
+    edges->node = NULL;
+    edges->stiffness = NULL;
+    edges->rest_len = NULL;
+}
+
+static void layout_steps_init(layout_steps_t *steps) {
+    steps->valid = false;
+    steps->ux = NULL;
+    steps->uy = NULL;
+    steps->scale = NULL;
+}
+
+// the finest layout takes the category of each paper, and a coarse layout
+// merges the categories of the children of each node
+static void layout_cats_build(layout_t *layout) {
+    layout_cats_t *cats = &layout->cats;
+    cats->start = m_new(int, layout->num_nodes + 1);
+
+    if (layout->child_layout == NULL) {
+        cats->cat = m_new(byte, layout->num_nodes);
+        cats->num = m_new(int, layout->num_nodes);
+        for (int i = 0; i < layout->num_nodes; i++) {
+            cats->start[i] = i;
+            cats->cat[i] = layout->nodes[i].paper->allcats[0];
+            cats->num[i] = 1;
+        }
+        cats->start[layout->num_nodes] = layout->num_nodes;
+        return;
+    }
+
+    // a node has no more entries than its children together
+    layout_t *child_layout = layout->child_layout;
+    layout_cats_t *child_cats = &child_layout->cats;
+    int max_entries = child_cats->start[child_layout->num_nodes];
+    cats->cat = m_new(byte, max_entries);
+    cats->num = m_new(int, max_entries);
+
+    int k = 0;
+    for (int i = 0; i < layout->num_nodes; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        cats->start[i] = k;
+        int c1 = n->child1 - child_layout->nodes;
+        int j1 = child_cats->start[c1];
+        int j1_hi = child_cats->start[c1 + 1];
+        int j2 = 0;
+        int j2_hi = 0;
+        if (n->child2 != NULL) {
+            int c2 = n->child2 - child_layout->nodes;
+            j2 = child_cats->start[c2];
+            j2_hi = child_cats->start[c2 + 1];
+        }
+        // merge the two sorted lists
+        while (j1 < j1_hi || j2 < j2_hi) {
+            if (j2 == j2_hi || (j1 < j1_hi && child_cats->cat[j1] < child_cats->cat[j2])) {
+                cats->cat[k] = child_cats->cat[j1];
+                cats->num[k++] = child_cats->num[j1++];
+            } else if (j1 == j1_hi || child_cats->cat[j2] < child_cats->cat[j1]) {
+                cats->cat[k] = child_cats->cat[j2];
+                cats->num[k++] = child_cats->num[j2++];
+            } else {
+                cats->cat[k] = child_cats->cat[j1];
+                cats->num[k++] = child_cats->num[j1++] + child_cats->num[j2++];
+            }
+        }
+    }
+    cats->start[layout->num_nodes] = k;
+    cats->cat = m_renew(byte, cats->cat, k);
+    cats->num = m_renew(int, cats->num, k);
+}
+
+// a link between a node and another node with a higher index; links with
+// the same other node are kept in the order of the list they are in
+typedef struct _layout_link_ref_t {
+    layout_node_t *other;
+    layout_link_t *link;
+} layout_link_ref_t;
+
+// merging is done for chunks of nodes, this many per thread
+#define LAYOUT_MERGE_CHUNKS_PER_THREAD (16)
+
+typedef struct _layout_merge_env_t {
+    layout_t *layout;
+    int num_chunks;
+    int *in_start;                  // links to node i from higher nodes are at [in_start[i], in_start[i + 1])
+    layout_link_ref_t *in;
+} layout_merge_env_t;
+
+typedef struct _layout_merge_thread_t {
+    int alloc;
+    layout_link_ref_t *out;
+} layout_merge_thread_t;
+
+static int num_merge_threads = 0;
+static layout_merge_thread_t *merge_threads = NULL;
+
+static int layout_link_ref_cmp(const void *in1, const void *in2) {
+    const layout_link_ref_t *r1 = in1;
+    const layout_link_ref_t *r2 = in2;
+    if (r1->other != r2->other) {
+        return r1->other < r2->other ? -1 : 1;
+    }
+    return r1->link < r2->link ? -1 : r1->link > r2->link;
+}
+
+// merges the links between node and each node2 with a higher index; a removed
+// link is left with a NULL node, and the lists are compacted afterwards
+static void layout_merge_links_of_node(layout_merge_env_t *env, layout_merge_thread_t *th, layout_node_t *node) {
+    int i = node - env->layout->nodes;
+    int in_lo = env->in_start[i];
+    int in_hi = env->in_start[i + 1];
+    if (in_lo == in_hi) {
+        return;
+    }
+
+    // the links of node to higher nodes, sorted by the node they go to
+    if (node->num_links > th->alloc) {
+        th->alloc = node->num_links;
+        th->out = m_renew(layout_link_ref_t, th->out, th->alloc);
+    }
+    int num_out = 0;
+    for (int j = 0; j < node->num_links; j++) {
+        layout_node_t *node2 = LAYOUT_LINK_GET_NODE(&node->links[j]);
+        if (node2 > node) {
+            th->out[num_out].other = node2;
+            th->out[num_out].link = &node->links[j];
+            num_out += 1;
+        }
+    }
+    qsort(th->out, num_out, sizeof(layout_link_ref_t), layout_link_ref_cmp);
+
+    // join with the links from higher nodes, which are already sorted
+    int o = 0;
+    int n = in_lo;
+    while (o < num_out && n < in_hi) {
+        if (th->out[o].other < env->in[n].other) {
+            o += 1;
+        } else if (env->in[n].other < th->out[o].other) {
+            n += 1;
+        } else {
+            layout_node_t *node2 = th->out[o].other;
+            int a_lo = o;
+            while (o < num_out && th->out[o].other == node2) {
+                o += 1;
+            }
+            int b_lo = n;
+            while (n < in_hi && env->in[n].other == node2) {
+                n += 1;
+            }
+            int num_a = o - a_lo;
+            int num_b = n - b_lo;
+
+            // the same as going through the links of node in order, each
+            // taking the weight of the first remaining link back from node2
+            int m = num_a < num_b ? num_a : num_b;
+            for (int k = 0; k < m; k++) {
+                layout_link_t *a = th->out[a_lo + k].link;
+                layout_link_t *b = env->in[b_lo + k].link;
+                LAYOUT_LINK_SET_WEIGHT(a, LAYOUT_LINK_GET_WEIGHT(a) + LAYOUT_LINK_GET_WEIGHT(b));
+                LAYOUT_LINK_SET_NODE(b, NULL);
+            }
+
+            // and then the links of node2 left over, each taking the weight of
+            // the first remaining link from node
+            for (int k = 0; m + k < num_b && k < num_a; k++) {
+                layout_link_t *a = th->out[a_lo + k].link;
+                layout_link_t *b = env->in[b_lo + m + k].link;
+                LAYOUT_LINK_SET_WEIGHT(b, LAYOUT_LINK_GET_WEIGHT(b) + LAYOUT_LINK_GET_WEIGHT(a));
+                LAYOUT_LINK_SET_NODE(a, NULL);
+            }
+        }
+    }
+}
+
+static void layout_merge_links_task(void *env_in, int chunk, int thread) {
+    layout_merge_env_t *env = env_in;
+    layout_t *layout = env->layout;
+    int lo = (int64_t)layout->num_nodes * chunk / env->num_chunks;
+    int hi = (int64_t)layout->num_nodes * (chunk + 1) / env->num_chunks;
+    for (int i = lo; i < hi; i++) {
+        layout_merge_links_of_node(env, &merge_threads[thread], &layout->nodes[i]);
+    }
+}
+
+static void layout_compact_links_task(void *env_in, int chunk, int thread) {
+    layout_merge_env_t *env = env_in;
+    layout_t *layout = env->layout;
+    int lo = (int64_t)layout->num_nodes * chunk / env->num_chunks;
+    int hi = (int64_t)layout->num_nodes * (chunk + 1) / env->num_chunks;
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *node = &layout->nodes[i];
+        int k = 0;
+        for (int j = 0; j < node->num_links; j++) {
+            if (LAYOUT_LINK_GET_NODE(&node->links[j]) != NULL) {
+                node->links[k++] = node->links[j];
+            }
+        }
+        node->num_links = k;
+    }
+}
 
+// combine each link from a node to another with a link back, if there is one,
+// keeping the link of the node with the lower index; the links into each node
+// from higher nodes are gathered with a counting sort, and then the nodes are
+// done in parallel, each merging its links with higher nodes
 static void layout_combine_duplicate_links(layout_t *layout) {
-    // combine duplicate links
+    int num_threads = threadpool_get_num_threads();
+    if (num_threads > num_merge_threads) {
+        merge_threads = m_renew(layout_merge_thread_t, merge_threads, num_threads);
+        for (int t = num_merge_threads; t < num_threads; t++) {
+            merge_threads[t].alloc = 0;
+            merge_threads[t].out = NULL;
+        }
+        num_merge_threads = num_threads;
+    }
+
+    // count and place the links to each node from higher nodes
+    layout_merge_env_t env;
+    env.layout = layout;
+    env.num_chunks = LAYOUT_MERGE_CHUNKS_PER_THREAD * num_threads;
+    env.in_start = m_new0(int, layout->num_nodes + 1);
     for (int i = 0; i < layout->num_nodes; i++) {
         layout_node_t *node = &layout->nodes[i];
-        assert(node != NULL);
         for (int j = 0; j < node->num_links; j++) {
             layout_node_t *node2 = LAYOUT_LINK_GET_NODE(&node->links[j]);
-            float weight2 = LAYOUT_LINK_GET_WEIGHT(&node->links[j]);
             assert(node2 != NULL);
             assert(node2 != node); // shouldn't be any nodes linking to themselves
-            for (int k = 0; k < node2->num_links; k++) {
-                if (LAYOUT_LINK_GET_NODE(&node2->links[k]) == node) {
-                    // a duplicate link (node -> node2, and node2 -> node)
-                    weight2 += LAYOUT_LINK_GET_WEIGHT(&node2->links[k]);
-                    memmove(&node2->links[k], &node2->links[k + 1], (node2->num_links - k - 1) * sizeof(layout_link_t));
-                    node2->num_links -= 1;
-                    break;
-                }
+            if (node2 < node) {
+                env.in_start[node2 - layout->nodes + 1] += 1;
+            }
+        }
+    }
+    for (int i = 0; i < layout->num_nodes; i++) {
+        env.in_start[i + 1] += env.in_start[i];
+    }
+    env.in = m_new(layout_link_ref_t, env.in_start[layout->num_nodes]);
+    for (int i = 0; i < layout->num_nodes; i++) {
+        layout_node_t *node = &layout->nodes[i];
+        for (int j = 0; j < node->num_links; j++) {
+            layout_node_t *node2 = LAYOUT_LINK_GET_NODE(&node->links[j]);
+            if (node2 < node) {
+                int k = env.in_start[node2 - layout->nodes]++;
+                env.in[k].other = node;
+                env.in[k].link = &node->links[j];
             }
-
-            // store the updated weight
-            LAYOUT_LINK_SET_WEIGHT(&node->links[j], weight2);
         }
     }
+    for (int i = layout->num_nodes; i > 0; i--) {
+        env.in_start[i] = env.in_start[i - 1];
+    }
+    env.in_start[0] = 0;
+
+    // each pair of nodes is done by the lower one, so the nodes are independent
+    threadpool_run(env.num_chunks, layout_merge_links_task, &env);
+    threadpool_run(env.num_chunks, layout_compact_links_task, &env);
+    m_free(env.in_start);
+    m_free(env.in);
 
     // count number of links layout
     layout->num_links = 0;
@@ -146,6 +382,9 @@ layout_t *layout_build_from_papers(int num_papers, paper_t **papers, bool age_we
     layout->nodes = nodes;
     layout->num_links = num_total_links;
     layout->links = all_links;
+    layout_edges_init(&layout->edges);
+    layout_steps_init(&layout->steps);
+    layout_cats_build(layout);
 
     // combine duplicate links
     layout_combine_duplicate_links(layout);
@@ -153,75 +392,138 @@ layout_t *layout_build_from_papers(int num_papers, paper_t **papers, bool age_we
     return layout;
 }
 
-// count unique links in the 2 given arrays of links
-static size_t count_links(layout_node_t *node, unsigned int num_links2, layout_link_t *links2, unsigned int num_links3, layout_link_t *links3) {
-    size_t nl = 0;
-    for (int i = 0; i < num_links2 + num_links3; ++i) {
-        layout_link_t *link_to_add;
-        if (i < num_links2) {
-            link_to_add = &links2[i];
-        } else {
-            link_to_add = &links3[i - num_links2];
-        }
-        layout_node_t *link_to_add_node_parent = LAYOUT_LINK_GET_NODE(link_to_add)->parent;
+// where the link to each node of the reduced layout is in the list being
+// filled, valid if owner is the index of the node whose list it is
+typedef struct _layout_reduce_slot_t {
+    int owner;
+    int pos;
+} layout_reduce_slot_t;
+
+typedef struct _layout_reduce_thread_t {
+    int alloc;
+    layout_reduce_slot_t *slots;
+} layout_reduce_thread_t;
+
+typedef struct _layout_reduce_env_t {
+    int num_nodes2;
+    layout_node_t *nodes2;
+    int num_chunks;
+    size_t *start;                  // links of node i are at [start[i], start[i + 1])
+    layout_link_t *links;
+} layout_reduce_env_t;
+
+static int num_reduce_threads = 0;
+static layout_reduce_thread_t *reduce_threads = NULL;
+static size_t reduce_links_alloc = 0;
+static layout_link_t *reduce_links = NULL;
 
+// adds links2 to links in node, combining weights if destination already exists in links
+static void add_links(layout_node_t *nodes2, layout_reduce_slot_t *slots, int owner, unsigned int num_links2, layout_link_t *links2) {
+    layout_node_t *node = &nodes2[owner];
+    for (int i = 0; i < num_links2; i++) {
+        layout_link_t *link_to_add = &links2[i];
+        layout_node_t *link_to_add_node_parent = LAYOUT_LINK_GET_NODE(link_to_add)->parent;
+        float link_to_add_weight = LAYOUT_LINK_GET_WEIGHT(link_to_add);
         if (link_to_add_node_parent == node) {
             // a link to itself, don't include
             continue;
         }
 
-        // look to see if link already exists
-        bool found = false;
-        for (int j = 0; j < i; ++j) {
-            layout_node_t *l;
-            if (j < num_links2) {
-                l = LAYOUT_LINK_GET_NODE(&links2[j]);
-            } else {
-                l = LAYOUT_LINK_GET_NODE(&links3[j - num_links2]);
-            }
-            if (l->parent == link_to_add_node_parent) {
-                found = true;
-                break;
-            }
+        layout_reduce_slot_t *slot = &slots[link_to_add_node_parent - nodes2];
+        if (slot->owner == owner) {
+            // link already exists, combine weights
+            layout_link_t *link = &node->links[slot->pos];
+            LAYOUT_LINK_SET_WEIGHT(link, LAYOUT_LINK_GET_WEIGHT(link) + link_to_add_weight);
+        } else {
+            // link does not exist, make a new one
+            slot->owner = owner;
+            slot->pos = node->num_links;
+            LAYOUT_LINK_SET_WEIGHT(&node->links[node->num_links], link_to_add_weight);
+            LAYOUT_LINK_SET_NODE(&node->links[node->num_links], link_to_add_node_parent);
+            node->num_links += 1;
         }
+    }
+}
 
-        // link does not exist, count it as a new one
-        if (!found) {
-            nl += 1;
+static void layout_reduce_links_task(void *env_in, int chunk, int thread) {
+    layout_reduce_env_t *env = env_in;
+    layout_reduce_slot_t *slots = reduce_threads[thread].slots;
+    int lo = (int64_t)env->num_nodes2 * chunk / env->num_chunks;
+    int hi = (int64_t)env->num_nodes2 * (chunk + 1) / env->num_chunks;
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *node2 = &env->nodes2[i];
+        node2->links = &reduce_links[env->start[i]];
+        node2->num_links = 0;
+        add_links(env->nodes2, slots, i, node2->child1->num_links, node2->child1->links);
+        if (node2->child2 != NULL) {
+            add_links(env->nodes2, slots, i, node2->child2->num_links, node2->child2->links);
         }
     }
-    return nl;
 }
 
-// adds links2 to links in node, combining weights if destination already exists in links
-static void add_links(layout_node_t *node, unsigned int num_links2, layout_link_t *links2) {
-    for (int i = 0; i < num_links2; i++) {
-        layout_link_t *link_to_add = &links2[i];
-        layout_node_t *link_to_add_node_parent = LAYOUT_LINK_GET_NODE(link_to_add)->parent;
-        float link_to_add_weight = LAYOUT_LINK_GET_WEIGHT(link_to_add);
-        if (link_to_add_node_parent == node) {
-            // a link to itself, don't include
-            continue;
-        }
+static void layout_reduce_copy_task(void *env_in, int chunk, int thread) {
+    layout_reduce_env_t *env = env_in;
+    int lo = (int64_t)env->num_nodes2 * chunk / env->num_chunks;
+    int hi = (int64_t)env->num_nodes2 * (chunk + 1) / env->num_chunks;
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *node2 = &env->nodes2[i];
+        memcpy(&env->links[env->start[i]], node2->links, node2->num_links * sizeof(layout_link_t));
+        node2->links = &env->links[env->start[i]];
+    }
+}
 
-        // look to see if link already exists
-        bool found = false;
-        for (int j = 0; j < node->num_links; j++) {
-            if (LAYOUT_LINK_GET_NODE(&node->links[j]) == link_to_add_node_parent) {
-                // combine weights
-                LAYOUT_LINK_SET_WEIGHT(&node->links[j], LAYOUT_LINK_GET_WEIGHT(&node->links[j]) + link_to_add_weight);
-                found = true;
-                break;
-            }
+// make the links of the reduced layout from those of the children; each node
+// gathers its links into room for all the links of its children, finding
+// links to the same node with a table indexed by node, and then the links are
+// copied to an array of the right size
+static void layout_build_reduced_links(int num_nodes2, layout_node_t *nodes2) {
+    int num_threads = threadpool_get_num_threads();
+    if (num_threads > num_reduce_threads) {
+        reduce_threads = m_renew(layout_reduce_thread_t, reduce_threads, num_threads);
+        for (int t = num_reduce_threads; t < num_threads; t++) {
+            reduce_threads[t].alloc = 0;
+            reduce_threads[t].slots = NULL;
         }
+        num_reduce_threads = num_threads;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        layout_reduce_thread_t *th = &reduce_threads[t];
+        if (num_nodes2 > th->alloc) {
+            th->alloc = num_nodes2;
+            th->slots = m_renew(layout_reduce_slot_t, th->slots, th->alloc);
+        }
+        for (int i = 0; i < num_nodes2; i++) {
+            th->slots[i].owner = -1;
+        }
+    }
 
-        // link does not exist, make a new one
-        if (!found) {
-            LAYOUT_LINK_SET_WEIGHT(&node->links[node->num_links], link_to_add_weight);
-            LAYOUT_LINK_SET_NODE(&node->links[node->num_links], link_to_add_node_parent);
-            node->num_links += 1;
+    // room for the links of each node is the number of links of its children
+    layout_reduce_env_t env;
+    env.num_nodes2 = num_nodes2;
+    env.nodes2 = nodes2;
+    env.num_chunks = LAYOUT_MERGE_CHUNKS_PER_THREAD * num_threads;
+    env.start = m_new(size_t, num_nodes2 + 1);
+    env.start[0] = 0;
+    for (int i = 0; i < num_nodes2; i++) {
+        layout_node_t *node2 = &nodes2[i];
+        env.start[i + 1] = env.start[i] + node2->child1->num_links;
+        if (node2->child2 != NULL) {
+            env.start[i + 1] += node2->child2->num_links;
         }
     }
+    if (env.start[num_nodes2] > reduce_links_alloc) {
+        reduce_links_alloc = env.start[num_nodes2];
+        reduce_links = m_renew(layout_link_t, reduce_links, reduce_links_alloc);
+    }
+    threadpool_run(env.num_chunks, layout_reduce_links_task, &env);
+
+    // allocate a big array for the new links, and move the links there
+    for (int i = 0; i < num_nodes2; i++) {
+        env.start[i + 1] = env.start[i] + nodes2[i].num_links;
+    }
+    env.links = m_new(layout_link_t, env.start[num_nodes2]);
+    threadpool_run(env.num_chunks, layout_reduce_copy_task, &env);
+    m_free(env.start);
 }
 
 typedef struct _node_weight_t {
@@ -378,35 +680,8 @@ layout_t *layout_build_reduced_from_layout(layout_t *layout) {
     }
     */
 
-    // count number of links needed for new, reduced layout
-    size_t total_links = 0;
-    for (int i = 0; i < num_nodes2; i++) {
-        layout_node_t *node2 = &nodes2[i];
-        total_links += count_links(node2,
-            node2->child1->num_links, node2->child1->links,
-            node2->child2 == NULL ? 0 : node2->child2->num_links,
-            node2->child2 == NULL ? NULL : node2->child2->links);
-    }
-
-    // allocate a big array for the new links
-    layout_link_t *new_links = m_new(layout_link_t, total_links);
-    layout_link_t *new_links_cur = new_links;
-
     // make links for new, reduced layout
-    for (int i = 0; i < num_nodes2; i++) {
-        layout_node_t *node2 = &nodes2[i];
-        node2->links = new_links_cur;
-        node2->num_links = 0;
-        add_links(node2, node2->child1->num_links, node2->child1->links);
-        if (node2->child2 != NULL) {
-            add_links(node2, node2->child2->num_links, node2->child2->links);
-        }
-        // use up some links from the big array
-        new_links_cur += node2->num_links;
-    }
-
-    // check we didn't overflow the big array of links
-    assert(new_links_cur <= new_links + total_links);
+    layout_build_reduced_links(num_nodes2, nodes2);
 
     // make layout object
     layout_t *layout2 = m_new(layout_t, 1);
@@ -416,7 +691,10 @@ layout_t *layout_build_reduced_from_layout(layout_t *layout) {
     layout2->nodes = nodes2;
     layout2->num_links = 0;
     layout2->links = NULL;
+    layout_edges_init(&layout2->edges);
+    layout_steps_init(&layout2->steps);
     layout->parent_layout = layout2;
+    layout_cats_build(layout2);
 
     // combine duplicate links
     layout_combine_duplicate_links(layout2);
@@ -424,7 +702,7 @@ layout_t *layout_build_reduced_from_layout(layout_t *layout) {
     return layout2;
 }
 
-static void layout_node_propagate_position_to_children(layout_t *layout, layout_node_t *node) {
+void layout_node_propagate_position_to_children(layout_t *layout, layout_node_t *node) {
     if (layout->child_layout != NULL) {
         node->child1->x = node->x;
         node->child1->y = node->y;
@@ -605,6 +883,8 @@ void layout_recompute_mass_radius(layout_t *layout) {
                 n->radius = sqrt(rad2);
             }
         }
+        // the rest lengths of the links depend on the radii
+        layout->edges.valid = false;
         if (layout->parent_layout != NULL) {
             layout = layout->parent_layout;
         } else {
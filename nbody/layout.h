@@ -62,6 +62,36 @@ typedef struct _layout_link_t {
     #endif
 } layout_link_t;
 
+// the links of each node in both directions, as flat arrays for the spring
+// force; built by force.c when needed, and again when the parameters change
+// or the masses and radii are recomputed
+typedef struct _layout_edges_t {
+    bool valid;
+    double link_strength;       // parameters the stiffness was computed with
+    bool use_ref_freq;
+    int *start;                 // links of node i are at [start[i], start[i + 1]), those from it first
+    int *node;                  // index of the node at the other end of each link
+    float *stiffness;
+    float *rest_len;
+} layout_edges_t;
+
+// per-node state of the adaptive step sizes of map.c, kept between iterations
+typedef struct _layout_steps_t {
+    bool valid;
+    float *ux;                  // direction of the force on node i at the last iteration
+    float *uy;
+    float *scale;               // step of node i, as a fraction of the global step size
+} layout_steps_t;
+
+// the categories of the papers under each node, with how many papers have
+// each, so that the locations of the categories can be worked out from the
+// nodes of any layout; uses the first category of each paper
+typedef struct _layout_cats_t {
+    int *start;                 // categories of node i are at [start[i], start[i + 1]), in increasing order
+    byte *cat;
+    int *num;
+} layout_cats_t;
+
 typedef struct _layout_t {
     struct _layout_t *parent_layout;
     struct _layout_t *child_layout;
@@ -69,12 +99,16 @@ typedef struct _layout_t {
     layout_node_t *nodes;
     int num_links;
     layout_link_t *links;
+    layout_edges_t edges;
+    layout_steps_t steps;
+    layout_cats_t cats;
 } layout_t;
 
 layout_t *layout_build_from_papers(int num_papers, struct _paper_t **papers, bool age_weaken, double factor_ref_freq, double factor_other_link);
 layout_t *layout_build_reduced_from_layout(layout_t *layout);
 
 void layout_propagate_positions_to_children(layout_t *layout);
+void layout_node_propagate_position_to_children(layout_t *layout, layout_node_t *node);
 void layout_print(layout_t *layout);
 layout_node_t *layout_get_node_by_id(layout_t *layout, unsigned int id);
 layout_node_t *layout_get_node_at(layout_t *layout, double x, double y);
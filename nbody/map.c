@@ -11,7 +11,11 @@
 #include "initconfig.h"
 #include "layout.h"
 #include "force.h"
+#include "forcekernel.h"
 #include "quadtree.h"
+#include "fmm.h"
+#include "dualtree.h"
+#include "threadpool.h"
 #include "map.h"
 
 map_env_t *map_env_new(init_config_t *init_config, category_set_t *cats) {
@@ -35,6 +39,11 @@ map_env_t *map_env_new(init_config_t *init_config, category_set_t *cats) {
     map_env->tr_x0 = 280;
     map_env->tr_y0 = 280;
 
+    map_env->integrator = MAP_INTEGRATOR_STEEPEST_DESCENT;
+    map_env->fire.layout = NULL;
+    map_env->fire.alloc = 0;
+    map_env->fire.vx = NULL;
+    map_env->fire.vy = NULL;
     map_env->energy = 0;
     map_env->progress = 0;
     map_env->step_size = 0.1;
@@ -51,6 +60,13 @@ map_env_t *map_env_new(init_config_t *init_config, category_set_t *cats) {
     map_env->use_external_cites = init_config->nbody.use_external_cites;
 
     map_env->mass_cites_exponent = init_config->nbody.mass_cites_exponent;
+    if (strcmp(init_config->nbody.integrator, "fire") == 0) {
+        map_env->integrator = MAP_INTEGRATOR_FIRE;
+    } else if (strcmp(init_config->nbody.integrator, "adaptive_steps") == 0) {
+        map_env->integrator = MAP_INTEGRATOR_ADAPTIVE_STEPS;
+    } else if (strcmp(init_config->nbody.integrator, "steepest_descent") != 0) {
+        printf("ERROR: unknown integrator '%s'; using steepest_descent\n", init_config->nbody.integrator);
+    }
 
     // defaults now set in init_config_new(...)
     map_env->force_params.close_repulsion_a  = init_config->nbody.forces.close_repulsion_a;
@@ -62,6 +78,41 @@ map_env_t *map_env_new(init_config_t *init_config, category_set_t *cats) {
     map_env->force_params.link_strength      = init_config->nbody.forces.link_strength;
     map_env->force_params.anti_gravity_falloff_rsq     = init_config->nbody.forces.anti_gravity_falloff_rsq;
     map_env->force_params.anti_gravity_falloff_rsq_inv = 1.0 / map_env->force_params.anti_gravity_falloff_rsq;
+    map_env->force_params.barnes_hut_opening = init_config->nbody.forces.barnes_hut_opening;
+    map_env->force_params.barnes_hut_group_size = init_config->nbody.forces.barnes_hut_group_size;
+    if (strcmp(init_config->nbody.forces.anti_gravity_solver, "fmm") == 0) {
+        map_env->force_params.anti_gravity_solver = FORCE_SOLVER_FMM;
+    } else if (strcmp(init_config->nbody.forces.anti_gravity_solver, "dual_tree") == 0) {
+        map_env->force_params.anti_gravity_solver = FORCE_SOLVER_DUAL_TREE;
+    } else {
+        if (strcmp(init_config->nbody.forces.anti_gravity_solver, "barnes_hut") != 0) {
+            printf("ERROR: unknown anti_gravity_solver '%s'; using barnes_hut\n", init_config->nbody.forces.anti_gravity_solver);
+        }
+        map_env->force_params.anti_gravity_solver = FORCE_SOLVER_BARNES_HUT;
+    }
+    map_env->force_params.fmm_order = init_config->nbody.forces.fmm_order;
+    if (map_env->force_params.fmm_order < 1 || map_env->force_params.fmm_order > FMM_MAX_ORDER) {
+        printf("ERROR: fmm_order must be between 1 and %d; using 6\n", FMM_MAX_ORDER);
+        map_env->force_params.fmm_order = 6;
+    }
+    map_env->quad_tree->leaf_size = init_config->nbody.forces.quadtree_leaf_size;
+    if (map_env->quad_tree->leaf_size < 1) {
+        printf("ERROR: quadtree_leaf_size must be at least 1; using 1\n");
+        map_env->quad_tree->leaf_size = 1;
+    }
+    map_env->quad_tree->random_shift = init_config->nbody.forces.quadtree_random_shift;
+    map_env->force_params.cache_ilists = init_config->nbody.forces.cache_interaction_lists;
+    map_env->force_params.mutual_near_field = init_config->nbody.forces.mutual_near_field;
+    map_env->force_params.fast_close_repulsion = init_config->nbody.forces.fast_close_repulsion;
+    map_env->force_params.close_repulsion_cell_list = init_config->nbody.forces.close_repulsion_cell_list;
+    map_env->force_params.close_repulsion_skin = init_config->nbody.forces.close_repulsion_skin;
+    if (map_env->force_params.close_repulsion_skin < 0) {
+        printf("ERROR: close_repulsion_skin must not be negative; using 1\n");
+        map_env->force_params.close_repulsion_skin = 1;
+    }
+    if (map_env->force_params.fast_close_repulsion && init_config->nbody.forces.check_fast_close_repulsion) {
+        force_kernel_check_fast_close_repulsion(&map_env->force_params);
+    }
 
     map_env->background_col[0] = init_config->tiles.background_col[0];
     map_env->background_col[1] = init_config->tiles.background_col[1];
@@ -221,6 +272,10 @@ void map_env_set_do_close_repulsion(map_env_t *map_env, bool value) {
     map_env->force_params.do_close_repulsion = value;
 }
 
+void map_env_set_refit_quad_tree(map_env_t *map_env, bool value) {
+    map_env->quad_tree->allow_refit = value;
+}
+
 void map_env_set_make_fake_links(map_env_t *map_env, bool value) {
     map_env->make_fake_links = value;
 }
@@ -350,6 +405,12 @@ void map_env_jolt(map_env_t *map_env, double amt) {
     }
 }
 
+// copies the positions of the current layout down to the finer layouts, and
+// so to the papers; the iterations only move the current layout
+void map_env_propagate_positions(map_env_t *map_env) {
+    layout_propagate_positions_to_children(map_env->layout);
+}
+
 void map_env_rotate_all(map_env_t *map_env, double angle) {
     layout_rotate_all(map_env->layout, angle);
 }
@@ -523,25 +584,138 @@ void compute_keyword_force(force_params_t *param, int num_papers, paper_t **pape
 }
 */
 
-static void compute_category_locations(map_env_t *map_env) {
-    for (int i = 0; i < category_set_get_num(map_env->category_set); i++) {
-        category_info_t *cat = category_set_get_by_id(map_env->category_set, i);
-        cat->num = 0;
-        cat->y = 0.0;
-        cat->x = 0.0;
-    }
-    for (int i = 0; i < map_env->num_papers; i++) {
-        paper_t *p = map_env->papers[i];
-        category_info_t *cat = category_set_get_by_id(map_env->category_set, p->allcats[0]);
-        cat->num += 1;
-        cat->x += p->layout_node->x;
-        cat->y += p->layout_node->y;
+// the passes over the layout-nodes at each iteration are split into chunks
+// run by the thread pool, each chunk keeping its own sums, which are then
+// combined in chunk order
+#define MAP_CHUNKS_PER_THREAD (16)
+
+// sums over the layout-nodes, for the statistics of an iteration
+typedef struct _map_step_stats_t {
+    double energy;
+    double max_fmag;
+    double x_sum;
+    double y_sum;
+    double xsq_sum;
+    double ysq_sum;
+    double total_mass;
+} map_step_stats_t;
+
+static inline void map_step_stats_add(map_step_stats_t *st, layout_node_t *n, double fmag) {
+    st->energy += fmag;
+    st->max_fmag = fmax(st->max_fmag, fmag);
+    st->x_sum += n->x * n->mass;
+    st->y_sum += n->y * n->mass;
+    st->xsq_sum += n->x * n->x * n->mass;
+    st->ysq_sum += n->y * n->y * n->mass;
+    st->total_mass += n->mass;
+}
+
+static inline void map_step_stats_merge(map_step_stats_t *st, const map_step_stats_t *st2) {
+    st->energy += st2->energy;
+    st->max_fmag = fmax(st->max_fmag, st2->max_fmag);
+    st->x_sum += st2->x_sum;
+    st->y_sum += st2->y_sum;
+    st->xsq_sum += st2->xsq_sum;
+    st->ysq_sum += st2->ysq_sum;
+    st->total_mass += st2->total_mass;
+}
+
+// what one chunk of a pass gives back
+typedef struct _map_chunk_t {
+    map_step_stats_t st;
+    double sum;             // power, for FIRE
+    double max;             // largest link force, step fraction or move
+    unsigned int flags;     // flags of the layout-nodes or'd together
+} map_chunk_t;
+
+typedef struct _map_sweep_env_t {
+    map_env_t *map_env;
+    layout_node_t *hold_still;
+    int num_chunks;
+    int num_items;          // layout-nodes, or papers
+    double a, b;            // parameters of the pass
+    bool uphill;            // for FIRE
+} map_sweep_env_t;
+
+static int map_chunks_alloc = 0;
+static map_chunk_t *map_chunks = NULL;
+static int map_cat_sums_alloc = 0;
+static double *map_cat_sums = NULL;     // x, y and number of papers for each category, for each chunk
+
+// runs fun over the layout-nodes, or the papers, of map_env in chunks
+static void map_env_sweep(map_sweep_env_t *env, int num_items, threadpool_task_fun_t fun) {
+    env->num_chunks = MAP_CHUNKS_PER_THREAD * threadpool_get_num_threads();
+    env->num_items = num_items;
+    if (env->num_chunks > map_chunks_alloc) {
+        map_chunks_alloc = env->num_chunks;
+        map_chunks = m_renew(map_chunk_t, map_chunks, map_chunks_alloc);
+    }
+    for (int c = 0; c < env->num_chunks; c++) {
+        map_chunk_t *chunk = &map_chunks[c];
+        memset(&chunk->st, 0, sizeof(chunk->st));
+        chunk->sum = 0;
+        chunk->max = 0;
+        chunk->flags = 0;
+    }
+    threadpool_run(env->num_chunks, fun, env);
+}
+
+static inline void map_sweep_range(map_sweep_env_t *env, int chunk, int *lo, int *hi) {
+    *lo = (int64_t)env->num_items * chunk / env->num_chunks;
+    *hi = (int64_t)env->num_items * (chunk + 1) / env->num_chunks;
+}
+
+// sums the position of each layout-node, once for each of the papers under
+// it, into the sums of its chunk for their categories; all the papers under
+// a layout-node are at its position, so this works on any layout
+static void map_category_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    map_env_t *map_env = env->map_env;
+    layout_t *layout = map_env->layout;
+    layout_cats_t *cats = &layout->cats;
+    double *sums = &map_cat_sums[3 * category_set_get_num(map_env->category_set) * chunk];
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        for (int k = cats->start[i]; k < cats->start[i + 1]; k++) {
+            double *s = &sums[3 * cats->cat[k]];
+            s[0] += n->x * cats->num[k];
+            s[1] += n->y * cats->num[k];
+            s[2] += cats->num[k];
+        }
     }
-    for (int i = 0; i < category_set_get_num(map_env->category_set); i++) {
+}
+
+static void compute_category_locations(map_env_t *map_env) {
+    int num_cats = category_set_get_num(map_env->category_set);
+    map_sweep_env_t env = {map_env, NULL};
+    int num_chunks = MAP_CHUNKS_PER_THREAD * threadpool_get_num_threads();
+    if (3 * num_cats * num_chunks > map_cat_sums_alloc) {
+        map_cat_sums_alloc = 3 * num_cats * num_chunks;
+        map_cat_sums = m_renew(double, map_cat_sums, map_cat_sums_alloc);
+    }
+    memset(map_cat_sums, 0, 3 * num_cats * num_chunks * sizeof(double));
+    map_env_sweep(&env, map_env->layout->num_nodes, map_category_task);
+
+    for (int i = 0; i < num_cats; i++) {
+        double x = 0;
+        double y = 0;
+        double num = 0;
+        for (int c = 0; c < num_chunks; c++) {
+            double *s = &map_cat_sums[3 * (num_cats * c + i)];
+            x += s[0];
+            y += s[1];
+            num += s[2];
+        }
         category_info_t *cat = category_set_get_by_id(map_env->category_set, i);
-        if (cat->num > 0) {
-            cat->x /= cat->num;
-            cat->y /= cat->num;
+        cat->num = num;
+        if (num > 0) {
+            cat->x = x / num;
+            cat->y = y / num;
+        } else {
+            cat->x = 0;
+            cat->y = 0;
         }
     }
 }
@@ -550,36 +724,99 @@ static bool layout_node_is_not_held(layout_node_t *n) {
     return (n->flags & LAYOUT_NODE_HOLD_STILL) == 0;
 }
 
-static void map_env_compute_forces(map_env_t *map_env) {
-    // reset the forces, and work out if any nodes are held
-    int any_nodes_held = 0;
-    for (int i = 0; i < map_env->layout->num_nodes; i++) {
-        layout_node_t *n = &map_env->layout->nodes[i];
-        any_nodes_held |= (n->flags & LAYOUT_NODE_HOLD_STILL);
+// rotates the layout-nodes by the angle with cosine a and sine b, unless b
+// is 0, and resets their forces
+static void map_prepare_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    layout_t *layout = env->map_env->layout;
+    unsigned int flags = 0;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        if (env->b != 0) {
+            double x = n->x;
+            double y = n->y;
+            n->x = env->a * x - env->b * y;
+            n->y = env->b * x + env->a * y;
+        }
         n->fx = 0;
         n->fy = 0;
+        flags |= n->flags;
+    }
+    map_chunks[chunk].flags = flags;
+}
+
+static void map_link_force_max_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    layout_t *layout = env->map_env->layout;
+    double max_fmag = 0;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        max_fmag = fmax(max_fmag, (double)n->fx * (double)n->fx + (double)n->fy * (double)n->fy);
     }
+    map_chunks[chunk].max = max_fmag;
+}
 
-    // rotate everything by a little each iteration to eliminate artifacts from quad tree force algo
-    map_env_rotate_all(map_env, 0.002);
+static void map_env_compute_forces(map_env_t *map_env) {
+    map_sweep_env_t env = {map_env, NULL};
+
+    // reset the forces, and work out if any nodes are held; rotate everything
+    // by a little each iteration to eliminate artifacts from quad tree force algo,
+    // unless the quad tree moves its cells around itself
+    double angle = map_env->quad_tree->random_shift ? 0 : 0.002;
+    env.a = cos(angle);
+    env.b = sin(angle);
+    map_env_sweep(&env, map_env->layout->num_nodes, map_prepare_task);
+    int any_nodes_held = 0;
+    for (int c = 0; c < env.num_chunks; c++) {
+        any_nodes_held |= map_chunks[c].flags & LAYOUT_NODE_HOLD_STILL;
+    }
 
-    // compute node-link-node spring forces
-    force_compute_attractive_link_force(&map_env->force_params, map_env->do_tred, map_env->layout);
+    // compute node-link-node spring forces; they only need the positions, so
+    // with threads they run alongside the building of the quad tree, which
+    // does not touch the forces
+    force_queue_attractive_link_force(&map_env->force_params, map_env->do_tred, map_env->layout);
+    quadtree_update(map_env->layout, map_env->quad_tree);
+    threadpool_run_queued();
 
     // compute maximum force (purely for user display, to make sure it's not too huge)
+    map_env_sweep(&env, map_env->layout->num_nodes, map_link_force_max_task);
     double max_fmag = 0;
-    for (int i = 0; i < map_env->layout->num_nodes; i++) {
-        layout_node_t *n = &map_env->layout->nodes[i];
-        max_fmag = fmax(max_fmag, (double)n->fx * (double)n->fx + (double)n->fy * (double)n->fy);
+    for (int c = 0; c < env.num_chunks; c++) {
+        max_fmag = fmax(max_fmag, map_chunks[c].max);
     }
     map_env->max_link_force_mag = sqrt(max_fmag);
 
-    // compute node-node anti-gravity forces using quad tree
-    quadtree_build(map_env->layout, map_env->quad_tree);
-    if (any_nodes_held) {
-        force_quad_tree_apply_if(&map_env->force_params, map_env->quad_tree, layout_node_is_not_held);
+    // compute node-node anti-gravity forces using quad tree; with a cell list
+    // for close repulsion, the tree only does anti-gravity
+    force_params_t *param = &map_env->force_params;
+    force_params_t tree_param = *param;
+    bool cell_list = param->do_close_repulsion && param->close_repulsion_cell_list;
+    if (cell_list) {
+        tree_param.do_close_repulsion = false;
+    }
+    if (param->anti_gravity_solver == FORCE_SOLVER_FMM) {
+        if (any_nodes_held) {
+            fmm_forces_apply_if(&tree_param, map_env->quad_tree, layout_node_is_not_held);
+        } else {
+            fmm_forces(&tree_param, map_env->quad_tree);
+        }
+    } else if (param->anti_gravity_solver == FORCE_SOLVER_DUAL_TREE) {
+        if (any_nodes_held) {
+            dual_tree_forces_apply_if(&tree_param, map_env->quad_tree, layout_node_is_not_held);
+        } else {
+            dual_tree_forces(&tree_param, map_env->quad_tree);
+        }
+    } else if (any_nodes_held) {
+        force_quad_tree_forces_not_held(&tree_param, map_env->quad_tree);
     } else {
-        force_quad_tree_forces(&map_env->force_params, map_env->quad_tree);
+        force_quad_tree_forces(&tree_param, map_env->quad_tree);
+    }
+    if (cell_list) {
+        force_close_repulsion_cell_list(param, map_env->layout, any_nodes_held);
     }
 
     //compute_keyword_force(&map_env->force_params, map_env->num_papers, map_env->papers);
@@ -587,95 +824,135 @@ static void map_env_compute_forces(map_env_t *map_env) {
     //attract_disconnected_to_centre_of_category(map_env);
 }
 
-bool map_env_iterate(map_env_t *map_env, layout_node_t *hold_still, bool boost_step_size, bool very_fine_steps) {
-    map_env_compute_forces(map_env);
-
-    // boost the step size if asked
-    if (boost_step_size) {
-        if (map_env->step_size < 1) {
-            map_env->step_size = 2;
-        } else {
-            map_env->step_size *= 2;
-        }
-    }
-
-    // when doing close repulsion, make sure step size is not too big
-    if (map_env->force_params.do_close_repulsion) {
-        map_env->step_size = fmin(1.0, map_env->step_size);
-    }
-
-    // when doing very fine steps, make sure the step size is small
-    if (very_fine_steps) {
-        map_env->step_size = fmin(0.05, map_env->step_size);
-    }
+// constants of the FIRE integrator; the time step is in the units of the
+// layout, where the force on a layout-node is divided by its mass
+#define MAP_FIRE_N_MIN          (5)     // iterations with positive power before the time step grows
+#define MAP_FIRE_F_INC          (1.1)
+#define MAP_FIRE_F_DEC          (0.5)
+#define MAP_FIRE_ALPHA_START    (0.1)
+#define MAP_FIRE_F_ALPHA        (0.99)
+#define MAP_FIRE_DT_START       (0.1)
+#define MAP_FIRE_DT_MAX         (1.0)
+#define MAP_FIRE_MAX_MOVE       (5.0)   // largest distance a layout-node may move in one iteration
+
+// the energy jitters with FIRE, so it has converged once the energy has not
+// dropped by this fraction for this many iterations
+#define MAP_FIRE_STALL_DROP     (0.1)
+#define MAP_FIRE_STALL_ITERATIONS (25)
+
+// the force per unit mass on a layout-node, and its magnitude
+static inline double map_node_accel(layout_node_t *n) {
+    n->fx /= n->mass;
+    n->fy /= n->mass;
+    double fmag = (double)n->fx * (double)n->fx + (double)n->fy * (double)n->fy;
+    if (!isfinite(fmag)) {
+        fmag = 1e100;
+    }
+    return sqrt(fmag);
+}
 
-    // use the computed forces to update the (x,y) positions of the papers
-    double energy = 0;
-    double x_sum = 0;
-    double y_sum = 0;
-    double xsq_sum = 0;
-    double ysq_sum = 0;
-    double total_mass = 0;
-    double max_fmag = 0;
-    for (int i = 0; i < map_env->layout->num_nodes; i++) {
+// moves each layout-node by step_size along its force
+static void map_step_steepest_descent_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    map_env_t *map_env = env->map_env;
+    map_step_stats_t *st = &map_chunks[chunk].st;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
         layout_node_t *n = &map_env->layout->nodes[i];
 
-        n->fx /= n->mass;
-        n->fy /= n->mass;
-
-        double fmag = (double)n->fx * (double)n->fx + (double)n->fy * (double)n->fy;
-        if (!isfinite(fmag)) {
-            fmag = 1e100;
-        }
-        fmag = sqrt(fmag);
-        max_fmag = fmax(max_fmag, fmag);
-
-        energy += fmag;
+        double fmag = map_node_accel(n);
 
         double dt = map_env->step_size / fmag;
         if (!isfinite(dt)) {
             dt = 1;
         }
 
-        if (!(n == hold_still || (n->flags & LAYOUT_NODE_HOLD_STILL))) {
+        if (!(n == env->hold_still || (n->flags & LAYOUT_NODE_HOLD_STILL))) {
             n->x += dt * n->fx;
             n->y += dt * n->fy;
         }
 
-        x_sum += n->x * n->mass;
-        y_sum += n->y * n->mass;
-        xsq_sum += n->x * n->x * n->mass;
-        ysq_sum += n->y * n->y * n->mass;
-        total_mass += n->mass;
+        map_step_stats_add(st, n, fmag);
     }
+}
 
-    map_env->max_total_force_mag = max_fmag;
+// per layout-node adaptive steps for steepest descent: a layout-node whose
+// force swings round by more than a right angle between iterations halves its
+// own step, and otherwise regrows it towards the global step size, so that
+// oscillating layout-nodes are damped without slowing the rest of the layout
+#define MAP_STEP_SCALE_MIN      (1.0 / 64)
+#define MAP_STEP_SCALE_GROW     (1.2)
+#define MAP_STEP_SCALE_SHRINK   (0.5)
+
+static void map_env_steps_init(layout_t *layout) {
+    layout_steps_t *steps = &layout->steps;
+    if (steps->scale == NULL) {
+        steps->ux = m_new(float, layout->num_nodes);
+        steps->uy = m_new(float, layout->num_nodes);
+        steps->scale = m_new(float, layout->num_nodes);
+    }
+    for (int i = 0; i < layout->num_nodes; i++) {
+        steps->ux[i] = 0;
+        steps->uy[i] = 0;
+        steps->scale[i] = 1;
+    }
+    steps->valid = true;
+}
 
-    // centre papers on the centre of mass
-    x_sum /= total_mass;
-    y_sum /= total_mass;
-    for (int i = 0; i < map_env->layout->num_nodes; i++) {
-        layout_node_t *n = &map_env->layout->nodes[i];
-        if (n == hold_still) {
-            continue;
+// moves each layout-node by its own fraction of step_size along its force,
+// and finds the largest such fraction
+static void map_step_adaptive_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    map_env_t *map_env = env->map_env;
+    layout_t *layout = map_env->layout;
+    layout_steps_t *steps = &layout->steps;
+    map_step_stats_t *st = &map_chunks[chunk].st;
+
+    double scale_max = 0;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+
+        double fmag = map_node_accel(n);
+
+        // direction of the force, and how far it swung since the last iteration
+        double ux = 0;
+        double uy = 0;
+        if (fmag > 0 && fmag < 1e100) {
+            ux = n->fx / fmag;
+            uy = n->fy / fmag;
         }
-        n->x -= x_sum;
-        n->y -= y_sum;
-    }
+        double cos_swing = ux * steps->ux[i] + uy * steps->uy[i];
+        if (cos_swing < 0) {
+            steps->scale[i] = fmax(MAP_STEP_SCALE_SHRINK * steps->scale[i], MAP_STEP_SCALE_MIN);
+        } else if (cos_swing > 0) {
+            steps->scale[i] = fmin(MAP_STEP_SCALE_GROW * steps->scale[i], 1);
+        }
+        steps->ux[i] = ux;
+        steps->uy[i] = uy;
+        scale_max = fmax(scale_max, steps->scale[i]);
 
-    // compute standard deviation in x, y
-    xsq_sum /= total_mass;
-    ysq_sum /= total_mass;
-    map_env->x_sd = sqrt(xsq_sum - x_sum * x_sum);
-    map_env->y_sd = sqrt(ysq_sum - y_sum * y_sum);
+        double dt = map_env->step_size * steps->scale[i] / fmag;
+        if (!isfinite(dt)) {
+            dt = 1;
+        }
 
-    // propagate node positions to children (to calculate locations of categories)
-    layout_propagate_positions_to_children(map_env->layout);
+        if (!(n == env->hold_still || (n->flags & LAYOUT_NODE_HOLD_STILL))) {
+            n->x += dt * n->fx;
+            n->y += dt * n->fy;
+        }
 
-    // update the locations of the categories
-    compute_category_locations(map_env);
+        map_step_stats_add(st, n, fmag);
+    }
 
-    // adjust the step size
+    map_chunks[chunk].max = scale_max;
+}
+
+// adjusts the step size from the change in energy, and says if converged,
+// which is when the layout-nodes move by no more than step_scale * step_size
+static bool map_env_adjust_steepest_descent(map_env_t *map_env, double energy, double step_scale, bool very_fine_steps) {
     if (!isfinite(energy)) {
         map_env->step_size = 2;
     } else if (energy < map_env->energy) {
@@ -694,7 +971,6 @@ bool map_env_iterate(map_env_t *map_env, layout_node_t *hold_still, bool boost_s
             map_env->step_size *= 0.95;
         }
     }
-    map_env->energy = energy;
 
     if (!very_fine_steps && map_env->force_params.do_close_repulsion && map_env->max_total_force_mag > pow(map_env->max_link_force_mag, 2)) {
         if (map_env->step_size < 0.15) {
@@ -703,7 +979,253 @@ bool map_env_iterate(map_env_t *map_env, layout_node_t *hold_still, bool boost_s
         return false;
     }
 
-    return map_env->step_size <= 1e-1;
+    return map_env->step_size * step_scale <= 1e-1;
+}
+
+// power of the forces on the velocities, for FIRE
+static void map_fire_power_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    layout_t *layout = env->map_env->layout;
+    map_fire_t *fire = &env->map_env->fire;
+    double power = 0;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        power += (double)n->fx * fire->vx[i] + (double)n->fy * fire->vy[i];
+    }
+    map_chunks[chunk].sum = power;
+}
+
+// moves the layout-nodes with time step a and largest move b, and finds the largest move
+static void map_step_fire_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    layout_t *layout = env->map_env->layout;
+    map_fire_t *fire = &env->map_env->fire;
+    map_step_stats_t *st = &map_chunks[chunk].st;
+    double dt = env->a;
+    double max_move = env->b;
+    double alpha = fire->alpha;
+
+    double move_max = 0;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+
+        double fmag = map_node_accel(n);
+
+        if (n == env->hold_still || (n->flags & LAYOUT_NODE_HOLD_STILL) || !(fmag < 1e100)) {
+            fire->vx[i] = 0;
+            fire->vy[i] = 0;
+        } else {
+            double vx = 0;
+            double vy = 0;
+            if (!env->uphill) {
+                // mix the velocity towards the force
+                double vmag = sqrt((double)fire->vx[i] * fire->vx[i] + (double)fire->vy[i] * fire->vy[i]);
+                double mix = fmag > 0 ? alpha * vmag / fmag : 0;
+                vx = (1 - alpha) * fire->vx[i] + mix * n->fx;
+                vy = (1 - alpha) * fire->vy[i] + mix * n->fy;
+            }
+            vx += dt * n->fx;
+            vy += dt * n->fy;
+
+            // limit the move, and the velocity with it
+            double dx = dt * vx;
+            double dy = dt * vy;
+            double move = sqrt(dx * dx + dy * dy);
+            if (move > max_move) {
+                double fac = max_move / move;
+                dx *= fac;
+                dy *= fac;
+                vx *= fac;
+                vy *= fac;
+                move = max_move;
+            }
+            move_max = fmax(move_max, move);
+
+            n->x += dx;
+            n->y += dy;
+            fire->vx[i] = vx;
+            fire->vy[i] = vy;
+        }
+
+        map_step_stats_add(st, n, fmag);
+    }
+
+    map_chunks[chunk].max = move_max;
+}
+
+// FIRE (Bitzek et al, PRL 97, 170201): the layout-nodes have velocities, which
+// are mixed towards the force and grow while the power F.v stays positive, and
+// are zeroed, with a smaller time step, as soon as it goes negative; the move
+// of each layout-node is limited to max_move, as the forces cover many orders
+// of magnitude, and the mixing is done per layout-node for the same reason
+static void map_env_step_fire(map_env_t *map_env, map_sweep_env_t *env, double max_move, bool restart) {
+    layout_t *layout = map_env->layout;
+    map_fire_t *fire = &map_env->fire;
+
+    // start afresh for a new layout, or when asked
+    if (restart || fire->layout != layout || fire->num_nodes != layout->num_nodes) {
+        if (layout->num_nodes > fire->alloc) {
+            fire->alloc = layout->num_nodes;
+            fire->vx = m_renew(float, fire->vx, fire->alloc);
+            fire->vy = m_renew(float, fire->vy, fire->alloc);
+        }
+        for (int i = 0; i < layout->num_nodes; i++) {
+            fire->vx[i] = 0;
+            fire->vy[i] = 0;
+        }
+        fire->layout = layout;
+        fire->num_nodes = layout->num_nodes;
+        fire->dt = MAP_FIRE_DT_START;
+        fire->alpha = MAP_FIRE_ALPHA_START;
+        fire->num_positive = 0;
+        fire->energy_ref = INFINITY;
+        fire->num_stalled = 0;
+    }
+
+    // power of the forces on the velocities
+    map_env_sweep(env, layout->num_nodes, map_fire_power_task);
+    double power = 0;
+    for (int c = 0; c < env->num_chunks; c++) {
+        power += map_chunks[c].sum;
+    }
+    env->uphill = !(power > 0);
+    if (env->uphill) {
+        fire->dt = fmax(MAP_FIRE_F_DEC * fire->dt, 1e-3 * MAP_FIRE_DT_START);
+        fire->alpha = MAP_FIRE_ALPHA_START;
+        fire->num_positive = 0;
+    } else {
+        fire->num_positive += 1;
+        if (fire->num_positive > MAP_FIRE_N_MIN) {
+            fire->dt = fmin(MAP_FIRE_F_INC * fire->dt, MAP_FIRE_DT_MAX);
+            fire->alpha *= MAP_FIRE_F_ALPHA;
+        }
+    }
+
+    env->a = fire->dt;
+    env->b = max_move;
+    map_env_sweep(env, layout->num_nodes, map_step_fire_task);
+}
+
+// centres the layout-nodes by moving them by (-a, -b)
+static void map_centre_task(void *env_in, int chunk, int thread) {
+    map_sweep_env_t *env = env_in;
+    layout_t *layout = env->map_env->layout;
+    int lo, hi;
+    map_sweep_range(env, chunk, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        if (n != env->hold_still) {
+            n->x -= env->a;
+            n->y -= env->b;
+        }
+    }
+}
+
+bool map_env_iterate(map_env_t *map_env, layout_node_t *hold_still, bool boost_step_size, bool very_fine_steps) {
+    map_env_compute_forces(map_env);
+
+    map_sweep_env_t env = {map_env, hold_still};
+    double step_scale = 1;
+    if (map_env->integrator == MAP_INTEGRATOR_FIRE) {
+        // the same limits on the move as for the step size of steepest
+        // descent; a boost starts the velocities afresh
+        double max_move = MAP_FIRE_MAX_MOVE;
+        if (map_env->force_params.do_close_repulsion) {
+            max_move = fmin(1.0, max_move);
+        }
+        if (very_fine_steps) {
+            max_move = fmin(0.05, max_move);
+        }
+        map_env_step_fire(map_env, &env, max_move, boost_step_size);
+    } else {
+        // boost the step size if asked
+        if (boost_step_size) {
+            if (map_env->step_size < 1) {
+                map_env->step_size = 2;
+            } else {
+                map_env->step_size *= 2;
+            }
+        }
+
+        // when doing close repulsion, make sure step size is not too big
+        if (map_env->force_params.do_close_repulsion) {
+            map_env->step_size = fmin(1.0, map_env->step_size);
+        }
+
+        // when doing very fine steps, make sure the step size is small
+        if (very_fine_steps) {
+            map_env->step_size = fmin(0.05, map_env->step_size);
+        }
+
+        // use the computed forces to update the (x,y) positions of the papers
+        if (map_env->integrator == MAP_INTEGRATOR_ADAPTIVE_STEPS) {
+            if (boost_step_size || !map_env->layout->steps.valid) {
+                // the layout-nodes start again from the full step size
+                map_env_steps_init(map_env->layout);
+            }
+            map_env_sweep(&env, map_env->layout->num_nodes, map_step_adaptive_task);
+        } else {
+            map_env_sweep(&env, map_env->layout->num_nodes, map_step_steepest_descent_task);
+        }
+    }
+
+    // combine the sums of the chunks
+    map_step_stats_t st = {0, 0, 0, 0, 0, 0, 0};
+    double chunk_max = 0;
+    for (int c = 0; c < env.num_chunks; c++) {
+        map_step_stats_merge(&st, &map_chunks[c].st);
+        chunk_max = fmax(chunk_max, map_chunks[c].max);
+    }
+    if (map_env->integrator == MAP_INTEGRATOR_FIRE) {
+        // for display, and for the test for convergence
+        map_env->step_size = chunk_max;
+    } else if (map_env->integrator == MAP_INTEGRATOR_ADAPTIVE_STEPS) {
+        step_scale = chunk_max;
+    }
+
+    map_env->max_total_force_mag = st.max_fmag;
+
+    // centre papers on the centre of mass
+    double x_sum = st.x_sum / st.total_mass;
+    double y_sum = st.y_sum / st.total_mass;
+    env.a = x_sum;
+    env.b = y_sum;
+    map_env_sweep(&env, map_env->layout->num_nodes, map_centre_task);
+
+    // compute standard deviation in x, y
+    double xsq_sum = st.xsq_sum / st.total_mass;
+    double ysq_sum = st.ysq_sum / st.total_mass;
+    map_env->x_sd = sqrt(xsq_sum - x_sum * x_sum);
+    map_env->y_sd = sqrt(ysq_sum - y_sum * y_sum);
+
+    // update the locations of the categories; the positions of the finer
+    // layouts are only brought up to date when they are needed, by
+    // map_env_propagate_positions
+    compute_category_locations(map_env);
+
+    if (map_env->integrator == MAP_INTEGRATOR_FIRE) {
+        map_fire_t *fire = &map_env->fire;
+        map_env->energy = st.energy;
+        if (st.energy < (1 - MAP_FIRE_STALL_DROP) * fire->energy_ref) {
+            fire->energy_ref = st.energy;
+            fire->num_stalled = 0;
+        } else {
+            fire->num_stalled += 1;
+        }
+        if (!very_fine_steps && map_env->force_params.do_close_repulsion && map_env->max_total_force_mag > pow(map_env->max_link_force_mag, 2)) {
+            return false;
+        }
+        return fire->num_stalled >= MAP_FIRE_STALL_ITERATIONS;
+    }
+
+    // adjust the step size
+    bool converged = map_env_adjust_steepest_descent(map_env, st.energy, step_scale, very_fine_steps);
+    map_env->energy = st.energy;
+    return converged;
 
     #if 0
     // work out maximum force
@@ -1182,6 +1704,8 @@ void vstr_add_json_str(vstr_t *vstr, const char *s) {
 */
 
 void map_env_layout_pos_save_to_json(map_env_t *map_env, const char *file) {
+    map_env_propagate_positions(map_env);
+
     // write the positions as JSON to a vstr
     vstr_t *vstr = vstr_new();
     vstr_printf(vstr, "[\n");
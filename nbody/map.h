@@ -9,6 +9,25 @@
 #include "layout.h"
 #include "force.h"
 
+// integrators that move the layout-nodes along their forces at each iteration
+#define MAP_INTEGRATOR_STEEPEST_DESCENT (0)    // each layout-node moves step_size along its force
+#define MAP_INTEGRATOR_FIRE             (1)    // fast inertial relaxation engine, with velocities
+#define MAP_INTEGRATOR_ADAPTIVE_STEPS   (2)    // steepest descent with a step per layout-node, damped where it swings
+
+// state of the FIRE integrator, kept between iterations
+typedef struct _map_fire_t {
+    layout_t *layout;       // layout the velocities are for, NULL to start afresh
+    int num_nodes;
+    int alloc;
+    float *vx;              // velocity of each layout-node
+    float *vy;
+    double dt;              // time step
+    double alpha;           // mixing of the velocities towards the forces
+    int num_positive;       // number of iterations since the power was last negative
+    double energy_ref;      // energy when it last dropped by a good fraction
+    int num_stalled;        // number of iterations since then
+} map_fire_t;
+
 typedef struct _map_env_t {
     // loaded
     int max_num_papers;
@@ -38,9 +57,11 @@ typedef struct _map_env_t {
     double tr_x0;
     double tr_y0;
 
+    int integrator;         // one of MAP_INTEGRATOR_xxx
+    map_fire_t fire;
     double energy;
     int progress;
-    double step_size;
+    double step_size;       // for FIRE, the largest distance a layout-node moved in the last iteration
     double max_link_force_mag;
     double max_total_force_mag;
 
@@ -84,6 +105,7 @@ double map_env_get_link_strength(map_env_t *map_env);
 double map_env_get_anti_gravity(map_env_t *map_env);
 void map_env_set_step_size(map_env_t *map_env, double value);
 void map_env_set_do_close_repulsion(map_env_t *map_env, bool value);
+void map_env_set_refit_quad_tree(map_env_t *map_env, bool value);
 void map_env_set_make_fake_links(map_env_t *map_env, bool value);
 void map_env_set_other_links_veto(map_env_t *map_env, bool value);
 void map_env_set_anti_gravity(map_env_t *map_env, double val);
@@ -105,6 +127,7 @@ int map_env_number_of_finer_layouts(map_env_t *map_env);
 void map_env_coarsen_layout(map_env_t *map_env);
 void map_env_refine_layout(map_env_t *map_env);
 void map_env_jolt(map_env_t *map_env, double amt);
+void map_env_propagate_positions(map_env_t *map_env);
 void map_env_rotate_all(map_env_t *map_env, double angle);
 void map_env_orient_using_category(map_env_t *map_env, category_info_t *wanted_cat, double wanted_angle);
 void map_env_orient_using_paper(map_env_t *map_env, paper_t *wanted_paper, double wanted_angle);
@@ -124,24 +124,23 @@ static void draw_category_labels(cairo_t *cr, map_env_t *map_env) {
     }
 }
 
-static void quad_tree_draw_grid(cairo_t *cr, quadtree_node_t *q, double min_x, double min_y, double max_x, double max_y) {
-    if (q != NULL) {
-        if (q->num_items == 1) {
-            cairo_rectangle(cr, min_x, min_y, max_x - min_x, max_y - min_y);
-            cairo_fill(cr);
-        } else if (q->num_items > 1) {
-            double mid_x = 0.5 * (min_x + max_x);
-            double mid_y = 0.5 * (min_y + max_y);
-            cairo_move_to(cr, min_x, mid_y);
-            cairo_line_to(cr, max_x, mid_y);
-            cairo_move_to(cr, mid_x, min_y);
-            cairo_line_to(cr, mid_x, max_y);
-            cairo_stroke(cr);
-            quad_tree_draw_grid(cr, q->q0, min_x, min_y, mid_x, mid_y);
-            quad_tree_draw_grid(cr, q->q1, mid_x, min_y, max_x, mid_y);
-            quad_tree_draw_grid(cr, q->q2, min_x, mid_y, mid_x, max_y);
-            quad_tree_draw_grid(cr, q->q3, mid_x, mid_y, max_x, max_y);
-        }
+static void quad_tree_draw_grid(cairo_t *cr, quadtree_t *qt, int q, double min_x, double min_y, double max_x, double max_y) {
+    if (quadtree_is_leaf(qt, q)) {
+        cairo_rectangle(cr, min_x, min_y, max_x - min_x, max_y - min_y);
+        cairo_fill(cr);
+    } else {
+        double mid_x = 0.5 * (min_x + max_x);
+        double mid_y = 0.5 * (min_y + max_y);
+        cairo_move_to(cr, min_x, mid_y);
+        cairo_line_to(cr, max_x, mid_y);
+        cairo_move_to(cr, mid_x, min_y);
+        cairo_line_to(cr, mid_x, max_y);
+        cairo_stroke(cr);
+        int c = qt->first[q];
+        if (qt->child_mask[q] & 1) { quad_tree_draw_grid(cr, qt, c++, min_x, min_y, mid_x, mid_y); }
+        if (qt->child_mask[q] & 2) { quad_tree_draw_grid(cr, qt, c++, mid_x, min_y, max_x, mid_y); }
+        if (qt->child_mask[q] & 4) { quad_tree_draw_grid(cr, qt, c++, min_x, mid_y, mid_x, max_y); }
+        if (qt->child_mask[q] & 8) { quad_tree_draw_grid(cr, qt, c++, mid_x, mid_y, max_x, max_y); }
     }
 }
 
@@ -200,7 +199,9 @@ static void draw_all(map_env_t *map_env, cairo_t *cr, int width, int height) {
         // the quad tree grid
         cairo_set_line_width(cr, line_width_1px);
         cairo_set_source_rgba(cr, 0, 0, 0, 0.3);
-        quad_tree_draw_grid(cr, map_env->quad_tree->root, map_env->quad_tree->min_x, map_env->quad_tree->min_y, map_env->quad_tree->max_x, map_env->quad_tree->max_y);
+        if (map_env->quad_tree->num_cells > 0) {
+            quad_tree_draw_grid(cr, map_env->quad_tree, QUADTREE_ROOT, map_env->quad_tree->min_x, map_env->quad_tree->min_y, map_env->quad_tree->max_x, map_env->quad_tree->max_y);
+        }
     }
 
     // links
@@ -328,7 +329,8 @@ static void draw_all(map_env_t *map_env, cairo_t *cr, int width, int height) {
 }
 
 void map_env_draw(map_env_t *map_env, cairo_t *cr, int width, int height, vstr_t* vstr_info) {
-    //layout_propagate_positions_to_children(map_env->layout); this is now done each force iteration
+    // the papers are drawn at the positions of the finest layout
+    map_env_propagate_positions(map_env);
 
     draw_all(map_env, cr, width, height);
 
@@ -39,6 +39,7 @@ void map_env_layout_pos_load_from_db(map_env_t *map_env, init_config_t *init_con
 
 void map_env_layout_pos_save_to_db(map_env_t *map_env, init_config_t *init_config) {
     // get the finest layout, corresponding to one layout_node per paper
+    map_env_propagate_positions(map_env);
     layout_t *l = map_env->layout;
     while (l->child_layout != NULL) {
         l = l->child_layout;
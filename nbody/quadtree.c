@@ -6,119 +6,758 @@
 #include "util/xiwilib.h"
 #include "layout.h"
 #include "quadtree.h"
+#include "threadpool.h"
 
-static quadtree_pool_t *quad_tree_pool_new(int alloc, quadtree_pool_t *next) {
-    quadtree_pool_t *qtp = m_new(quadtree_pool_t, 1);
-    qtp->num_nodes_alloc = alloc;
-    qtp->num_nodes_used = 0;
-    qtp->nodes = m_new(quadtree_node_t, qtp->num_nodes_alloc);
-    qtp->next = next;
-    return qtp;
-}
-
-static void quad_tree_pool_free_all(quadtree_pool_t *qtp) {
-    for (; qtp != NULL; qtp = qtp->next) {
-        qtp->num_nodes_used = 0;
-    }
-}
-
-static quadtree_node_t *quad_tree_pool_alloc(quadtree_t *qt) {
-    // look for a free node
-    for (quadtree_pool_t *qtp = qt->quad_tree_pool; qtp != NULL; qtp = qtp->next) {
-        if (qtp->num_nodes_used < qtp->num_nodes_alloc) {
-            return &qtp->nodes[qtp->num_nodes_used++];
-        }
-    }
-    // ran out of pre-allocated nodes, so allocate some more
-    qt->quad_tree_pool = quad_tree_pool_new(qt->quad_tree_pool->num_nodes_alloc * 2, qt->quad_tree_pool);
-    return &qt->quad_tree_pool->nodes[qt->quad_tree_pool->num_nodes_used++];
-}
-
-static void quad_tree_insert_layout_node(quadtree_t *qt, quadtree_node_t *parent, quadtree_node_t **q, layout_node_t *ln, double min_x, double min_y, double max_x, double max_y) {
-    if (*q == NULL) {
-        // hit an empty node; create a new leaf cell and put this layout-node in it
-        *q = quad_tree_pool_alloc(qt);
-        (*q)->parent = parent;
-        (*q)->side_length = max_x - min_x;
-        (*q)->num_items = 1;
-        (*q)->mass = ln->mass;
-        (*q)->x = ln->x;
-        (*q)->y = ln->y;
-        /*
-        (*q)->fx = 0;
-        (*q)->fy = 0;
-        */
-        (*q)->radius = ln->radius;
-        (*q)->item = ln;
-
-    } else if ((*q)->num_items == 1) {
-        // hit a leaf; turn it into an internal node and re-insert the layout-nodes
-        layout_node_t *ln0 = (*q)->item;
-        (*q)->mass = 0;
-        (*q)->x = 0;
-        (*q)->y = 0;
-        /*
-        (*q)->fx = 0;
-        (*q)->fy = 0;
-        */
-        (*q)->q0 = NULL;
-        (*q)->q1 = NULL;
-        (*q)->q2 = NULL;
-        (*q)->q3 = NULL;
-        (*q)->num_items = 0; // so it treats this node as an internal node
-        quad_tree_insert_layout_node(qt, parent, q, ln0, min_x, min_y, max_x, max_y);
-        (*q)->num_items = 0; // so it treats this node as an internal node
-        quad_tree_insert_layout_node(qt, parent, q, ln, min_x, min_y, max_x, max_y);
-        (*q)->num_items = 2; // we now have 2 layout-nodes in this node
+// number of levels of subdivision resolved by the Morton keys; each key
+// interleaves this many bits of the x and y positions, y in the odd bits
+#define MORTON_LEVELS (31)
+#define MORTON_MAX_COORD ((1u << MORTON_LEVELS) - 1)
 
+// the layout-nodes are split into chunks for computing keys and sorting
+#define MORTON_CHUNKS_PER_THREAD (4)
+#define MORTON_MAX_CHUNKS (256)
+
+// radix sort by 8 bits at a time
+#define MORTON_RADIX_BITS (8)
+#define MORTON_RADIX_SIZE (1 << MORTON_RADIX_BITS)
+
+// the previous order is reused if at most 1 in this many keys jumped further
+// than the window in which they are sorted by insertion
+#define MORTON_MAX_DISPLACED_FRACTION (16)
+#define MORTON_RESORT_WINDOW (32)
+
+// the tree is built in subtrees, at a depth which gives at least this many per thread
+#define MORTON_SUBTREES_PER_THREAD (16)
+
+// a refit is abandoned for a full build if more than 1 in this many items
+// have left their leaf, if any item is further outside its leaf than this
+// fraction of the leaf's side length, or if the layout-nodes now fit in a
+// square less than this fraction of the side length of the root
+#define REFIT_MAX_MIGRATED_FRACTION (32)
+#define REFIT_MAX_LOOSENESS (0.25)
+#define REFIT_MIN_ROOT_FILL (0.5)
+
+// with random_shift, the root cell is enlarged by up to this fraction of its side
+#define RANDOM_SHIFT_MAX_ENLARGE (0.25)
+
+/******************************************************************************/
+// building the quad tree from layout-nodes sorted by Morton key
+//
+// A Morton key interleaves the bits of the x and y positions, so sorting by
+// key puts the layout-nodes in the order of a depth first walk of the quad
+// tree.  The layout-nodes in any cell are then a contiguous range, which is
+// split into its 4 children by the 2 bits of the key at that level.  The
+// order is kept and the next sort starts from it, which is quick if the
+// layout-nodes have not moved much.
+
+typedef struct _morton_env_t {
+    quadtree_t *qt;
+    layout_node_t *nodes;
+    int num_nodes;
+    int num_chunks;
+    double scale;
+    int shift;
+    int hist[MORTON_MAX_CHUNKS][MORTON_RADIX_SIZE];
+} morton_env_t;
+
+// a subtree to be built by one task; its root cell is allocated along with
+// its siblings, and the cells below it in their own contiguous block
+typedef struct _morton_subtree_t {
+    int lo;
+    int hi;
+    int level;
+    int root;
+    int num_cells;          // not including the root
+    int first_cell;
+    int num_migrated;       // for a refit, number of items that left their leaf
+    bool too_far;           // for a refit, whether an item is too far outside its leaf
+} morton_subtree_t;
+
+static morton_env_t morton_env;
+
+// number of cells above the subtrees, including their roots, from the last build
+static int morton_num_top_cells = 0;
+
+static int morton_subtrees_alloc = 0;
+static int morton_num_subtrees = 0;
+static morton_subtree_t *morton_subtrees = NULL;
+
+static inline uint64_t morton_spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+static inline uint32_t morton_compact_bits(uint64_t x) {
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+    x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+    return x;
+}
+
+static inline uint32_t morton_coord(double v) {
+    if (!(v > 0)) {
+        return 0;
+    } else if (v >= MORTON_MAX_COORD) {
+        return MORTON_MAX_COORD;
     } else {
-        // hit an internal node
+        return v;
+    }
+}
 
-        // check cell size didn't get too small
-        if (fabs(min_x - max_x) < 1e-10 || fabs(min_y - max_y) < 1e-10) {
-            printf("ERROR: quad_tree_insert hit minimum cell size; moving node by random amount\n");
-            ln->x += 0.1 * ((double)random() / (double)RAND_MAX - 0.5);
-            ln->y += 0.1 * ((double)random() / (double)RAND_MAX - 0.5);
-            return;
+// which child (0-3, as for q0-q3) the key is in at the given level
+static inline int morton_child(uint64_t key, int level) {
+    return (key >> (2 * (MORTON_LEVELS - 1 - level))) & 3;
+}
+
+static inline int morton_chunk_start(morton_env_t *env, int chunk) {
+    return (int64_t)env->num_nodes * chunk / env->num_chunks;
+}
+
+static void morton_keys_task(void *env_in, int chunk, int thread) {
+    morton_env_t *env = env_in;
+    quadtree_t *qt = env->qt;
+    int hi = morton_chunk_start(env, chunk + 1);
+    for (int i = morton_chunk_start(env, chunk); i < hi; i++) {
+        layout_node_t *n = &env->nodes[qt->morton_order[i]];
+        uint32_t ix = morton_coord((n->x - qt->min_x) * env->scale);
+        uint32_t iy = morton_coord((n->y - qt->min_y) * env->scale);
+        qt->morton_keys[i] = morton_spread_bits(ix) | (morton_spread_bits(iy) << 1);
+    }
+}
+
+static void morton_radix_count_task(void *env_in, int chunk, int thread) {
+    morton_env_t *env = env_in;
+    int *hist = env->hist[chunk];
+    const uint64_t *keys = env->qt->morton_keys;
+    for (int d = 0; d < MORTON_RADIX_SIZE; d++) {
+        hist[d] = 0;
+    }
+    int hi = morton_chunk_start(env, chunk + 1);
+    for (int i = morton_chunk_start(env, chunk); i < hi; i++) {
+        hist[(keys[i] >> env->shift) & (MORTON_RADIX_SIZE - 1)] += 1;
+    }
+}
+
+static void morton_radix_scatter_task(void *env_in, int chunk, int thread) {
+    morton_env_t *env = env_in;
+    quadtree_t *qt = env->qt;
+    int *pos = env->hist[chunk];
+    int hi = morton_chunk_start(env, chunk + 1);
+    for (int i = morton_chunk_start(env, chunk); i < hi; i++) {
+        int p = pos[(qt->morton_keys[i] >> env->shift) & (MORTON_RADIX_SIZE - 1)]++;
+        qt->morton_keys_tmp[p] = qt->morton_keys[i];
+        qt->morton_order_tmp[p] = qt->morton_order[i];
+    }
+}
+
+// stable parallel LSD radix sort of the keys, along with the order
+static void morton_radix_sort(morton_env_t *env) {
+    quadtree_t *qt = env->qt;
+    for (env->shift = 0; env->shift < 2 * MORTON_LEVELS; env->shift += MORTON_RADIX_BITS) {
+        threadpool_run(env->num_chunks, morton_radix_count_task, env);
+
+        // turn the counts into the starting position for each digit in each chunk
+        int total = 0;
+        bool all_same_digit = false;
+        for (int d = 0; d < MORTON_RADIX_SIZE; d++) {
+            int total_d = 0;
+            for (int c = 0; c < env->num_chunks; c++) {
+                int count = env->hist[c][d];
+                env->hist[c][d] = total + total_d;
+                total_d += count;
+            }
+            if (total_d == env->num_nodes) {
+                all_same_digit = true;
+            }
+            total += total_d;
+        }
+        if (all_same_digit) {
+            // nothing to do for this digit
+            continue;
         }
 
-        // update centre of mass and mass of cell
-        (*q)->num_items += 1;
-        double new_mass = (*q)->mass + ln->mass;
-        (*q)->x = ((*q)->mass * (*q)->x + ln->mass * ln->x) / new_mass;
-        (*q)->y = ((*q)->mass * (*q)->y + ln->mass * ln->y) / new_mass;
-        (*q)->mass = new_mass;
+        threadpool_run(env->num_chunks, morton_radix_scatter_task, env);
 
-        // compute the dividing x and y positions
-        double mid_x = 0.5 * (min_x + max_x);
-        double mid_y = 0.5 * (min_y + max_y);
+        uint64_t *keys = qt->morton_keys;
+        qt->morton_keys = qt->morton_keys_tmp;
+        qt->morton_keys_tmp = keys;
+        int *order = qt->morton_order;
+        qt->morton_order = qt->morton_order_tmp;
+        qt->morton_order_tmp = order;
+    }
+}
 
-        // insert the new layout-node in the correct cell
-        if (ln->y < mid_y) {
-            if (ln->x < mid_x) {
-                quad_tree_insert_layout_node(qt, *q, &(*q)->q0, ln, min_x, min_y, mid_x, mid_y);
-            } else {
-                quad_tree_insert_layout_node(qt, *q, &(*q)->q1, ln, mid_x, min_y, max_x, mid_y);
+// an entry that is out of order with respect to the previous sort
+typedef struct _morton_displaced_t {
+    uint64_t key;
+    int index;
+} morton_displaced_t;
+
+static int morton_displaced_alloc = 0;
+static morton_displaced_t *morton_displaced = NULL;
+
+static int morton_displaced_compare(const void *a_in, const void *b_in) {
+    const morton_displaced_t *a = a_in;
+    const morton_displaced_t *b = b_in;
+    if (a->key < b->key) {
+        return -1;
+    } else if (a->key > b->key) {
+        return 1;
+    } else {
+        return a->index - b->index;
+    }
+}
+
+// sort keys which are nearly sorted; entries that moved a short way are put in
+// place by insertion, while those that jumped far are taken out, sorted, and
+// merged back in; gives up (leaving the keys partially sorted) and returns
+// false if more than max_displaced entries jumped far
+static bool morton_resort(quadtree_t *qt, int n, int max_displaced) {
+    uint64_t *keys = qt->morton_keys;
+    int *order = qt->morton_order;
+
+    // sort in place into [0, num_kept), moving displaced entries out
+    int num_kept = 0;
+    int num_displaced = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t key = keys[i];
+        int index = order[i];
+        int j = num_kept;
+        if (i + 2 < n && key > keys[i + 1] && key > keys[i + 2]) {
+            // jumped forward
+            j = -1;
+        } else {
+            // find where it goes in the last few kept entries
+            int j_min = num_kept - MORTON_RESORT_WINDOW;
+            while (j > 0 && j > j_min && keys[j - 1] > key) {
+                j -= 1;
+            }
+            if (j > 0 && j == j_min && keys[j - 1] > key) {
+                // jumped backward
+                j = -1;
+            }
+        }
+        if (j < 0) {
+            if (num_displaced >= max_displaced) {
+                // leave the entries in a valid state for the full sort
+                for (; i < n; i++) {
+                    keys[num_kept] = keys[i];
+                    order[num_kept] = order[i];
+                    num_kept++;
+                }
+                for (int d = 0; d < num_displaced; d++) {
+                    keys[num_kept] = morton_displaced[d].key;
+                    order[num_kept] = morton_displaced[d].index;
+                    num_kept++;
+                }
+                return false;
             }
+            if (num_displaced >= morton_displaced_alloc) {
+                morton_displaced_alloc = morton_displaced_alloc == 0 ? 1024 : 2 * morton_displaced_alloc;
+                morton_displaced = m_renew(morton_displaced_t, morton_displaced, morton_displaced_alloc);
+            }
+            morton_displaced[num_displaced].key = key;
+            morton_displaced[num_displaced].index = index;
+            num_displaced++;
         } else {
-            if (ln->x < mid_x) {
-                quad_tree_insert_layout_node(qt, *q, &(*q)->q2, ln, min_x, mid_y, mid_x, max_y);
+            for (int k = num_kept; k > j; k--) {
+                keys[k] = keys[k - 1];
+                order[k] = order[k - 1];
+            }
+            keys[j] = key;
+            order[j] = index;
+            num_kept++;
+        }
+    }
+    if (num_displaced == 0) {
+        return true;
+    }
+
+    // merge from the end, into the space left by the displaced entries
+    qsort(morton_displaced, num_displaced, sizeof(morton_displaced_t), morton_displaced_compare);
+    int i = num_kept - 1;
+    int j = num_displaced - 1;
+    for (int w = n - 1; j >= 0; w--) {
+        if (i >= 0 && keys[i] > morton_displaced[j].key) {
+            keys[w] = keys[i];
+            order[w] = order[i];
+            i--;
+        } else {
+            keys[w] = morton_displaced[j].key;
+            order[w] = morton_displaced[j].index;
+            j--;
+        }
+    }
+    return true;
+}
+
+// split the range [lo, hi), all in the same cell at the given level, into its 4 children
+static void morton_split_range(const uint64_t *keys, int lo, int hi, int level, int bounds[5]) {
+    bounds[0] = lo;
+    bounds[4] = hi;
+    for (int c = 1; c < 4; c++) {
+        // binary search for the first key in child c or above
+        int l = bounds[c - 1];
+        int h = hi;
+        while (l < h) {
+            int m = l + (h - l) / 2;
+            if (morton_child(keys[m], level) < c) {
+                l = m + 1;
             } else {
-                quad_tree_insert_layout_node(qt, *q, &(*q)->q3, ln, mid_x, mid_y, max_x, max_y);
+                h = m;
             }
         }
+        bounds[c] = l;
+    }
+}
+
+// whether the cell for the range [lo, hi) at the given level is a leaf
+static inline bool morton_is_leaf(quadtree_t *qt, int lo, int hi, int level) {
+    return hi - lo <= qt->leaf_size || level == MORTON_LEVELS;
+}
+
+// number of cells below the cell for the range [lo, hi) at the given level
+static int morton_count_cells(quadtree_t *qt, int lo, int hi, int level) {
+    if (morton_is_leaf(qt, lo, hi, level)) {
+        return 0;
+    }
+    int bounds[5];
+    morton_split_range(qt->morton_keys, lo, hi, level, bounds);
+    int count = 0;
+    for (int c = 0; c < 4; c++) {
+        if (bounds[c] < bounds[c + 1]) {
+            count += 1 + morton_count_cells(qt, bounds[c], bounds[c + 1], level + 1);
+        }
+    }
+    return count;
+}
+
+// set the mass, centre of mass, quadrupole moment and radius of an internal cell from its children
+static void quad_tree_cell_aggregate(quadtree_t *qt, int q) {
+    int c_lo = qt->first[q];
+    int c_hi = c_lo + quadtree_num_children(qt, q);
+    int num_items = 0;
+    double mass = 0;
+    double x = 0;
+    double y = 0;
+    float radius = 0;
+    for (int c = c_lo; c < c_hi; c++) {
+        num_items += qt->num_items[c];
+        mass += qt->mass[c];
+        x += qt->mass[c] * qt->x[c];
+        y += qt->mass[c] * qt->y[c];
+        if (qt->radius[c] > radius) {
+            radius = qt->radius[c];
+        }
+    }
+    x /= mass;
+    y /= mass;
+    double q_xx = 0;
+    double q_xy = 0;
+    for (int c = c_lo; c < c_hi; c++) {
+        // shift the child's moment to the centre of mass of this cell
+        double dx = qt->x[c] - x;
+        double dy = qt->y[c] - y;
+        q_xx += qt->q_xx[c] + qt->mass[c] * (dx * dx - dy * dy);
+        q_xy += qt->q_xy[c] + qt->mass[c] * dx * dy;
+    }
+    qt->num_items[q] = num_items;
+    qt->mass[q] = mass;
+    qt->x[q] = x;
+    qt->y[q] = y;
+    qt->q_xx[q] = q_xx;
+    qt->q_xy[q] = q_xy;
+    qt->radius[q] = radius;
+}
+
+// fill in leaf q, with the layout-nodes in the range [lo, hi)
+static void morton_build_leaf(quadtree_t *qt, layout_node_t *nodes, int q, int lo, int hi) {
+    double mass = 0;
+    double x = 0;
+    double y = 0;
+    float radius = 0;
+    for (int i = lo; i < hi; i++) {
+        layout_node_t *ln = &nodes[qt->morton_order[i]];
+        qt->item_x[i] = ln->x;
+        qt->item_y[i] = ln->y;
+        qt->item_mass[i] = ln->mass;
+        qt->item_radius[i] = ln->radius;
+        mass += ln->mass;
+        x += ln->mass * ln->x;
+        y += ln->mass * ln->y;
+        if (ln->radius > radius) {
+            radius = ln->radius;
+        }
+    }
+    x /= mass;
+    y /= mass;
+    double q_xx = 0;
+    double q_xy = 0;
+    for (int i = lo; i < hi; i++) {
+        double dx = qt->item_x[i] - x;
+        double dy = qt->item_y[i] - y;
+        q_xx += qt->item_mass[i] * (dx * dx - dy * dy);
+        q_xy += qt->item_mass[i] * dx * dy;
+    }
+    qt->num_items[q] = hi - lo;
+    qt->first[q] = lo;
+    qt->child_mask[q] = 0;
+    qt->mass[q] = mass;
+    qt->x[q] = x;
+    qt->y[q] = y;
+    qt->q_xx[q] = q_xx;
+    qt->q_xy[q] = q_xy;
+    qt->radius[q] = radius;
+}
+
+// allocate the children of cell q, which has the range [lo, hi) at the given
+// level, taking cells from *next; returns the bounds of the children's ranges
+static void morton_alloc_children(quadtree_t *qt, int q, int lo, int hi, int level, int *next, int bounds[5]) {
+    morton_split_range(qt->morton_keys, lo, hi, level, bounds);
+    qt->first[q] = *next;
+    qt->child_mask[q] = 0;
+    float side_length = ldexp(qt->max_x - qt->min_x, -(level + 1));
+    for (int c = 0; c < 4; c++) {
+        if (bounds[c] < bounds[c + 1]) {
+            qt->child_mask[q] |= 1 << c;
+            qt->parent[*next] = q;
+            qt->side_length[*next] = side_length;
+            *next += 1;
+        }
+    }
+}
+
+// fill in cell q and build the cells below it, for the range [lo, hi) at the
+// given level, taking cells from *next
+static void morton_build_cells(quadtree_t *qt, layout_node_t *nodes, int q, int lo, int hi, int level, int *next) {
+    if (morton_is_leaf(qt, lo, hi, level)) {
+        if (level == MORTON_LEVELS && hi - lo > 1) {
+            // layout-nodes are at the same position; move all but one apart
+            printf("ERROR: quad_tree_insert hit minimum cell size; moving node by random amount\n");
+            for (int i = lo + 1; i < hi; i++) {
+                layout_node_t *ln = &nodes[qt->morton_order[i]];
+                ln->x += 0.1 * ((double)random() / (double)RAND_MAX - 0.5);
+                ln->y += 0.1 * ((double)random() / (double)RAND_MAX - 0.5);
+            }
+        }
+        morton_build_leaf(qt, nodes, q, lo, hi);
+        return;
+    }
+
+    int bounds[5];
+    morton_alloc_children(qt, q, lo, hi, level, next, bounds);
+    int child = qt->first[q];
+    for (int c = 0; c < 4; c++) {
+        if (bounds[c] < bounds[c + 1]) {
+            morton_build_cells(qt, nodes, child++, bounds[c], bounds[c + 1], level + 1, next);
+        }
+    }
+    quad_tree_cell_aggregate(qt, q);
+}
+
+static void morton_subtrees_add(int lo, int hi, int level) {
+    if (morton_num_subtrees >= morton_subtrees_alloc) {
+        morton_subtrees_alloc = morton_subtrees_alloc == 0 ? 256 : 2 * morton_subtrees_alloc;
+        morton_subtrees = m_renew(morton_subtree_t, morton_subtrees, morton_subtrees_alloc);
+    }
+    morton_subtree_t *st = &morton_subtrees[morton_num_subtrees++];
+    st->lo = lo;
+    st->hi = hi;
+    st->level = level;
+}
+
+// collect the subtrees at split_level, and return the number of cells below
+// this one and above the subtrees, including the roots of the subtrees
+static int morton_collect_subtrees(quadtree_t *qt, int lo, int hi, int level, int split_level) {
+    if (level == split_level || morton_is_leaf(qt, lo, hi, level)) {
+        morton_subtrees_add(lo, hi, level);
+        return 0;
+    }
+    int bounds[5];
+    morton_split_range(qt->morton_keys, lo, hi, level, bounds);
+    int count = 0;
+    for (int c = 0; c < 4; c++) {
+        if (bounds[c] < bounds[c + 1]) {
+            count += 1 + morton_collect_subtrees(qt, bounds[c], bounds[c + 1], level + 1, split_level);
+        }
+    }
+    return count;
+}
+
+// build the cells above the subtrees, in the same order as they were
+// collected, and set the root cell of each subtree
+static void morton_build_top(quadtree_t *qt, int q, int lo, int hi, int level, int split_level, int *next, int *subtree) {
+    if (level == split_level || morton_is_leaf(qt, lo, hi, level)) {
+        morton_subtrees[(*subtree)++].root = q;
+        return;
+    }
+    int bounds[5];
+    morton_alloc_children(qt, q, lo, hi, level, next, bounds);
+    qt->num_items[q] = 0; // aggregated once the subtrees are built
+    int child = qt->first[q];
+    for (int c = 0; c < 4; c++) {
+        if (bounds[c] < bounds[c + 1]) {
+            morton_build_top(qt, child++, bounds[c], bounds[c + 1], level + 1, split_level, next, subtree);
+        }
+    }
+}
+
+static void morton_count_task(void *env_in, int task, int thread) {
+    morton_env_t *env = env_in;
+    morton_subtree_t *st = &morton_subtrees[task];
+    st->num_cells = morton_count_cells(env->qt, st->lo, st->hi, st->level);
+}
+
+static void morton_build_task(void *env_in, int task, int thread) {
+    morton_env_t *env = env_in;
+    morton_subtree_t *st = &morton_subtrees[task];
+    int next = st->first_cell;
+    morton_build_cells(env->qt, env->nodes, st->root, st->lo, st->hi, st->level, &next);
+    assert(next == st->first_cell + st->num_cells);
+}
+
+// make sure there is room for num_cells cells, keeping the arrays for the next build
+static void quad_tree_cells_alloc(quadtree_t *qt, int num_cells) {
+    if (num_cells > qt->cells_alloc) {
+        qt->cells_alloc = num_cells + num_cells / 4;
+        qt->x = m_renew(float, qt->x, qt->cells_alloc);
+        qt->y = m_renew(float, qt->y, qt->cells_alloc);
+        qt->mass = m_renew(float, qt->mass, qt->cells_alloc);
+        qt->side_length = m_renew(float, qt->side_length, qt->cells_alloc);
+        qt->num_items = m_renew(int, qt->num_items, qt->cells_alloc);
+        qt->first = m_renew(int, qt->first, qt->cells_alloc);
+        qt->child_mask = m_renew(byte, qt->child_mask, qt->cells_alloc);
+        qt->q_xx = m_renew(float, qt->q_xx, qt->cells_alloc);
+        qt->q_xy = m_renew(float, qt->q_xy, qt->cells_alloc);
+        qt->radius = m_renew(float, qt->radius, qt->cells_alloc);
+        qt->parent = m_renew(int, qt->parent, qt->cells_alloc);
+    }
+    qt->num_cells = num_cells;
+}
+
+static void quad_tree_build_morton(layout_t *layout, quadtree_t *qt) {
+    int n = layout->num_nodes;
+    int num_threads = threadpool_get_num_threads();
+
+    morton_env_t *env = &morton_env;
+    env->qt = qt;
+    env->nodes = layout->nodes;
+    env->num_nodes = n;
+    env->num_chunks = num_threads == 1 ? 1 : MORTON_CHUNKS_PER_THREAD * num_threads;
+    if (env->num_chunks > MORTON_MAX_CHUNKS) {
+        env->num_chunks = MORTON_MAX_CHUNKS;
+    }
+    env->scale = ldexp(1.0, MORTON_LEVELS) / (qt->max_x - qt->min_x);
+
+    // keep the order from the previous build if it's for the same layout-nodes
+    if (n > qt->morton_alloc) {
+        qt->morton_alloc = n;
+        qt->morton_keys = m_renew(uint64_t, qt->morton_keys, n);
+        qt->morton_keys_tmp = m_renew(uint64_t, qt->morton_keys_tmp, n);
+        qt->morton_order = m_renew(int, qt->morton_order, n);
+        qt->morton_order_tmp = m_renew(int, qt->morton_order_tmp, n);
+        qt->item_x = m_renew(float, qt->item_x, n);
+        qt->item_y = m_renew(float, qt->item_y, n);
+        qt->item_mass = m_renew(float, qt->item_mass, n);
+        qt->item_radius = m_renew(float, qt->item_radius, n);
+        qt->morton_layout_nodes = NULL;
+    }
+    if (layout->nodes != qt->morton_layout_nodes || n != qt->morton_num_layout_nodes) {
+        for (int i = 0; i < n; i++) {
+            qt->morton_order[i] = i;
+        }
+        qt->morton_layout_nodes = layout->nodes;
+        qt->morton_num_layout_nodes = n;
     }
+
+    // compute the keys and sort them, using the previous order if it's close
+    threadpool_run(env->num_chunks, morton_keys_task, env);
+    if (!morton_resort(qt, n, n / MORTON_MAX_DISPLACED_FRACTION)) {
+        morton_radix_sort(env);
+    }
+
+    // split the tree into subtrees, and count the cells in each
+    int split_level = 0;
+    if (num_threads > 1) {
+        while ((1 << (2 * split_level)) < MORTON_SUBTREES_PER_THREAD * num_threads) {
+            split_level += 1;
+        }
+    }
+    morton_num_subtrees = 0;
+    int num_top_cells = 1 + morton_collect_subtrees(qt, 0, n, 0, split_level);
+    threadpool_run(morton_num_subtrees, morton_count_task, env);
+
+    // give each subtree a contiguous block of cells, after the cells above them
+    int num_cells = num_top_cells;
+    for (int i = 0; i < morton_num_subtrees; i++) {
+        morton_subtrees[i].first_cell = num_cells;
+        num_cells += morton_subtrees[i].num_cells;
+    }
+    quad_tree_cells_alloc(qt, num_cells);
+
+    // build the cells above the subtrees, then the subtrees, then aggregate
+    // the cells above, children before parents
+    int next = QUADTREE_ROOT + 1;
+    int subtree = 0;
+    qt->parent[QUADTREE_ROOT] = -1;
+    qt->side_length[QUADTREE_ROOT] = qt->max_x - qt->min_x;
+    morton_build_top(qt, QUADTREE_ROOT, 0, n, 0, split_level, &next, &subtree);
+    assert(next == num_top_cells && subtree == morton_num_subtrees);
+    threadpool_run(morton_num_subtrees, morton_build_task, env);
+    for (int q = num_top_cells - 1; q >= 0; q--) {
+        if (qt->num_items[q] == 0) {
+            quad_tree_cell_aggregate(qt, q);
+        }
+    }
+    morton_num_top_cells = num_top_cells;
 }
 
+/******************************************************************************/
+// refitting the quad tree built by the last call to quad_tree_build_morton
+//
+// The keys and the cells are kept, so each item stays in the leaf it was put
+// in.  Before a refit, side_length holds the side length the cell was built
+// with, and after it the side length of the square with the same centre that
+// covers all the items of the cell.
+
+// refit leaf q, at the given level, with the given built side length
+static void refit_leaf(quadtree_t *qt, layout_node_t *nodes, int q, int level, float side, morton_subtree_t *st) {
+    int lo = qt->first[q];
+    int hi = lo + qt->num_items[q];
+    morton_build_leaf(qt, nodes, q, lo, hi);
+
+    // the centre of the leaf, from the key it was built with
+    uint64_t key = qt->morton_keys[lo];
+    int shift = MORTON_LEVELS - level;
+    double cen_x = qt->min_x + ((morton_compact_bits(key) >> shift) + 0.5) * side;
+    double cen_y = qt->min_y + ((morton_compact_bits(key >> 1) >> shift) + 0.5) * side;
+
+    // how far the items are outside the leaf
+    double excess = 0;
+    for (int i = lo; i < hi; i++) {
+        double d = fmax(fabs(qt->item_x[i] - cen_x), fabs(qt->item_y[i] - cen_y)) - 0.5 * side;
+        if (d > 0) {
+            st->num_migrated += 1;
+            excess = fmax(excess, d);
+        }
+    }
+    if (excess > REFIT_MAX_LOOSENESS * side) {
+        st->too_far = true;
+    }
+    qt->side_length[q] = side + 2 * excess;
+}
+
+// refit the internal cell q, which still has the side length it was built
+// with, from its refitted children
+static void refit_cell_aggregate(quadtree_t *qt, int q) {
+    float side = qt->side_length[q];
+    quad_tree_cell_aggregate(qt, q);
+    // a child's square is inside this one, touching its edges, so this one
+    // grows by as much as its children have grown most
+    float grow = 0;
+    int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+    for (int c = qt->first[q]; c < c_hi; c++) {
+        grow = fmaxf(grow, qt->side_length[c] - 0.5f * side);
+    }
+    qt->side_length[q] = side + grow;
+}
+
+static void refit_cells(quadtree_t *qt, layout_node_t *nodes, int q, int level, float side, morton_subtree_t *st) {
+    if (quadtree_is_leaf(qt, q)) {
+        refit_leaf(qt, nodes, q, level, side, st);
+        return;
+    }
+    int c_hi = qt->first[q] + quadtree_num_children(qt, q);
+    for (int c = qt->first[q]; c < c_hi; c++) {
+        refit_cells(qt, nodes, c, level + 1, 0.5f * side, st);
+    }
+    qt->side_length[q] = side;
+    refit_cell_aggregate(qt, q);
+}
+
+static void refit_task(void *env_in, int task, int thread) {
+    morton_env_t *env = env_in;
+    morton_subtree_t *st = &morton_subtrees[task];
+    st->num_migrated = 0;
+    st->too_far = false;
+    refit_cells(env->qt, env->nodes, st->root, st->level, env->qt->side_length[st->root], st);
+}
+
+// refit the tree to the new positions of the layout-nodes; returns false,
+// leaving the tree in an unusable state, if it must be rebuilt instead
+static bool quad_tree_refit(layout_t *layout, quadtree_t *qt) {
+    int n = layout->num_nodes;
+    if (qt->num_cells == 0 || layout->nodes != qt->morton_layout_nodes || n != qt->morton_num_layout_nodes) {
+        // not built for these layout-nodes
+        return false;
+    }
+
+    // the built side lengths of the cells above the subtrees, parents first
+    qt->side_length[QUADTREE_ROOT] = qt->max_x - qt->min_x;
+    for (int q = QUADTREE_ROOT + 1; q < morton_num_top_cells; q++) {
+        qt->side_length[q] = 0.5f * qt->side_length[qt->parent[q]];
+    }
+
+    morton_env_t *env = &morton_env;
+    env->qt = qt;
+    env->nodes = layout->nodes;
+    threadpool_run(morton_num_subtrees, refit_task, env);
+
+    int num_migrated = 0;
+    for (int i = 0; i < morton_num_subtrees; i++) {
+        if (morton_subtrees[i].too_far) {
+            return false;
+        }
+        num_migrated += morton_subtrees[i].num_migrated;
+    }
+    if (num_migrated > n / REFIT_MAX_MIGRATED_FRACTION) {
+        return false;
+    }
+
+    for (int q = morton_num_top_cells - 1; q >= 0; q--) {
+        if (!quadtree_is_leaf(qt, q)) {
+            refit_cell_aggregate(qt, q);
+        }
+    }
+    return true;
+}
+
+/******************************************************************************/
+
 quadtree_t *quadtree_new() {
-    quadtree_t *qt = m_new(quadtree_t, 1);
-    qt->quad_tree_pool = quad_tree_pool_new(1024, NULL);
-    qt->root = NULL;
+    quadtree_t *qt = m_new0(quadtree_t, 1);
+    qt->leaf_size = 1;
     return qt;
 }
 
+// work out the bounding box of all nodes, and return its larger side length
+static double quad_tree_bounding_box(layout_t *layout, double *min_x, double *min_y, double *max_x, double *max_y) {
+    layout_node_t *n0 = &layout->nodes[0];
+    *min_x = n0->x;
+    *min_y = n0->y;
+    *max_x = n0->x;
+    *max_y = n0->y;
+    for (int i = 1; i < layout->num_nodes; i++) {
+        layout_node_t *n = &layout->nodes[i];
+        if (n->x < *min_x) { *min_x = n->x; }
+        if (n->y < *min_y) { *min_y = n->y; }
+        if (n->x > *max_x) { *max_x = n->x; }
+        if (n->y > *max_y) { *max_y = n->y; }
+    }
+    return fmax(*max_x - *min_x, *max_y - *min_y);
+}
+
 void quadtree_build(layout_t *layout, quadtree_t *qt) {
-    qt->root = NULL;
+    qt->num_cells = 0;
+    qt->num_builds += 1;
 
     // if no nodes, return
     if (layout->num_nodes == 0) {
@@ -128,20 +767,8 @@ void quadtree_build(layout_t *layout, quadtree_t *qt) {
         qt->max_y = 0;
         return;
     }
-
     // first work out the bounding box of all nodes
-    layout_node_t *n0 = &layout->nodes[0];
-    qt->min_x = n0->x;
-    qt->min_y = n0->y;
-    qt->max_x = n0->x;
-    qt->max_y = n0->y;
-    for (int i = 1; i < layout->num_nodes; i++) {
-        layout_node_t *n = &layout->nodes[i];
-        if (n->x < qt->min_x) { qt->min_x = n->x; }
-        if (n->y < qt->min_y) { qt->min_y = n->y; }
-        if (n->x > qt->max_x) { qt->max_x = n->x; }
-        if (n->y > qt->max_y) { qt->max_y = n->y; }
-    }
+    quad_tree_bounding_box(layout, &qt->min_x, &qt->min_y, &qt->max_x, &qt->max_y);
 
     // increase the bounding box so it's square
     {
@@ -159,14 +786,39 @@ void quadtree_build(layout_t *layout, quadtree_t *qt) {
         //printf("quad tree bounding box: (%f,%f) -- (%f,%f)\n", qt->min_x, qt->min_y, qt->max_x, qt->max_y);
     }
 
+    // move the boundaries of the cells to somewhere new, so that the errors of
+    // the approximate forces do not build up in the same place each iteration;
+    // this does what rotating the whole layout a little each iteration does,
+    // without touching the positions of the layout-nodes
+    if (qt->random_shift) {
+        double side = qt->max_x - qt->min_x;
+        double extra = RANDOM_SHIFT_MAX_ENLARGE * side * random() / RAND_MAX;
+        double shift_x = extra * random() / RAND_MAX;
+        double shift_y = extra * random() / RAND_MAX;
+        qt->min_x -= shift_x;
+        qt->min_y -= shift_y;
+        qt->max_x += extra - shift_x;
+        qt->max_y += extra - shift_y;
+    }
+
     if (!isfinite(qt->min_x) || !isfinite(qt->min_y) || !isfinite(qt->max_x) || !isfinite(qt->max_y)) {
         printf("ERROR: quad tree bounds are not finite; exiting\n");
         exit(1);
     }
 
-    // build the quad tree
-    quad_tree_pool_free_all(qt->quad_tree_pool);
-    for (int i = 0; i < layout->num_nodes; i++) {
-        quad_tree_insert_layout_node(qt, NULL, &qt->root, &layout->nodes[i], qt->min_x, qt->min_y, qt->max_x, qt->max_y);
+    // build the quad tree from the layout-nodes sorted by Morton key
+    quad_tree_build_morton(layout, qt);
+}
+
+// refit the tree if allowed and the layout-nodes have not moved too much
+// since the last build, otherwise build it from scratch
+void quadtree_update(layout_t *layout, quadtree_t *qt) {
+    if (qt->allow_refit && layout->num_nodes > 0) {
+        double min_x, min_y, max_x, max_y;
+        double side = quad_tree_bounding_box(layout, &min_x, &min_y, &max_x, &max_y);
+        if (side >= REFIT_MIN_ROOT_FILL * (qt->max_x - qt->min_x) && quad_tree_refit(layout, qt)) {
+            return;
+        }
     }
+    quadtree_build(layout, qt);
 }
@@ -1,48 +1,81 @@
 #ifndef _INCLUDED_QUADTREE_H
 #define _INCLUDED_QUADTREE_H
 
-typedef struct _quadtree_node_t {
-    struct _quadtree_node_t *parent;
-    float side_length;      // cells are square
-    int num_items;          // if 1, this node is a leaf, else an internal node
-    float mass;             // total mass of this cell (sum of all children)
-    float x;                // centre of mass
-    float y;                // centre of mass
-    /* OBSOLETE
-    float fx;               // net force on this cell
-    float fy;               // net force on this cell
-    */
-    union {
-        struct {            // for a leaf
-            float radius;   // radius of item
-            void *item;     // pointer to actual item
-        };
-        struct {            // for an internal node
-            struct _quadtree_node_t *q0;
-            struct _quadtree_node_t *q1;
-            struct _quadtree_node_t *q2;
-            struct _quadtree_node_t *q3;
-        };
-    };
-} quadtree_node_t;
-
-typedef struct _quadtree_pool_t {
-    int num_nodes_alloc;
-    int num_nodes_used;
-    quadtree_node_t *nodes;
-    struct _quadtree_pool_t *next;
-} quadtree_pool_t;
+// The cells of the quad tree are stored in arrays, one entry per cell, and
+// referred to by their index.  The root is cell 0, and the children of an
+// internal cell are stored contiguously, after their parent.  The arrays are
+// reused between builds, and only grow.  A leaf holds up to leaf_size
+// layout-nodes (more only if they are at the same position), which are a
+// contiguous range of the layout-nodes sorted by Morton key.
+//
+// When the layout-nodes have only moved a little since the last build, the
+// tree can instead be refitted: the cells and the items in each leaf are
+// kept, and only their moments are recomputed.  An item that has left its
+// leaf stays in it, and the side length of the leaf (and of the cells above
+// it) is enlarged so that the cell still covers all its items.
+
+#define QUADTREE_ROOT (0)
 
 typedef struct _quadtree_t {
-    struct _quadtree_pool_t *quad_tree_pool;
     double min_x;
     double min_y;
     double max_x;
     double max_y;
-    quadtree_node_t *root;
+
+    int leaf_size;          // maximum number of layout-nodes in a leaf
+    bool allow_refit;       // whether quadtree_update may refit instead of rebuilding
+    bool random_shift;      // whether each build enlarges and shifts the root cell by a random amount
+    int num_cells;          // 0 if there are no layout-nodes
+    int num_builds;         // number of full builds; cells keep their index until the next one
+    int cells_alloc;
+
+    // fields used to walk the tree
+    float *x;               // centre of mass
+    float *y;               // centre of mass
+    float *mass;            // total mass of this cell (sum of all children)
+    float *side_length;     // cells are square; may be enlarged by a refit
+    int *num_items;         // number of layout-nodes in this cell
+    int *first;             // internal cell: index of first child; leaf: position of first item in morton_order
+    byte *child_mask;       // which of the children (bit 0-3 for q0-q3) an internal cell has, stored in that order; 0 for a leaf
+
+    // fields used less often
+    float *q_xx;            // quadrupole moment about the centre of mass, sum of m * (dx^2 - dy^2)
+    float *q_xy;            // quadrupole moment about the centre of mass, sum of m * dx * dy
+    float *radius;          // largest radius of its items
+    int *parent;            // -1 for the root
+
+    // layout-nodes sorted by Morton key, kept so the next build can start from the previous order
+    int morton_alloc;
+    uint64_t *morton_keys;
+    uint64_t *morton_keys_tmp;
+    int *morton_order;          // indices of the layout-nodes, sorted by key
+    int *morton_order_tmp;
+    layout_node_t *morton_layout_nodes;
+    int morton_num_layout_nodes;
+
+    // the layout-nodes in the same order, for the leaves
+    float *item_x;
+    float *item_y;
+    float *item_mass;
+    float *item_radius;
 } quadtree_t;
 
+static inline bool quadtree_is_leaf(const quadtree_t *qt, int c) {
+    return qt->child_mask[c] == 0;
+}
+
+static inline int quadtree_num_children(const quadtree_t *qt, int c) {
+    return __builtin_popcount(qt->child_mask[c]);
+}
+
+// the layout-node at position i in morton_order; the items of leaf c are at
+// positions first[c] to first[c] + num_items[c] - 1
+static inline layout_node_t *quadtree_get_item(const quadtree_t *qt, int i) {
+    return &qt->morton_layout_nodes[qt->morton_order[i]];
+}
+
 quadtree_t *quadtree_new();
 void quadtree_build(layout_t *layout, quadtree_t *qt);
+void quadtree_update(layout_t *layout, quadtree_t *qt);
 
 #endif // _INCLUDED_QUADTREE_H
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util/xiwilib.h"
+#include "threadpool.h"
+
+// the range of tasks still to do for a thread is packed into a single
+// 64-bit word (lo in the low half, hi in the high half) so that the owner
+// taking a task and a thief taking half the range can both use a single CAS
+#define RANGE_PACK(lo, hi) (((uint64_t)(uint32_t)(hi) << 32) | (uint32_t)(lo))
+#define RANGE_LO(r) ((int)(uint32_t)(r))
+#define RANGE_HI(r) ((int)(uint32_t)((r) >> 32))
+
+typedef struct _threadpool_thread_t {
+    uint64_t range;
+    int index;
+    pthread_t pthread;
+} __attribute__((aligned(64))) threadpool_thread_t;
+
+static int tp_num_threads = 0;
+static threadpool_thread_t *tp_threads = NULL;
+static pthread_barrier_t tp_b_start, tp_b_end;
+static threadpool_task_fun_t tp_fun;
+static void *tp_env;
+
+// the batch being run, and the queued tasks that are run after it
+static int tp_run_num_tasks;
+static threadpool_task_fun_t tp_run_fun;
+static void *tp_run_env;
+static int tp_queued_num_tasks = 0;
+static threadpool_task_fun_t tp_queued_fun;
+static void *tp_queued_env;
+
+// take the next task from the bottom of our own range
+static bool threadpool_pop(threadpool_thread_t *th, int *task) {
+    uint64_t r = __atomic_load_n(&th->range, __ATOMIC_ACQUIRE);
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (__atomic_compare_exchange_n(&th->range, &r, RANGE_PACK(RANGE_LO(r) + 1, RANGE_HI(r)), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *task = RANGE_LO(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+// take the top half of the remaining range of another thread and make it our own
+static bool threadpool_steal(threadpool_thread_t *th) {
+    for (int i = 1; i < tp_num_threads; i++) {
+        threadpool_thread_t *victim = &tp_threads[(th->index + i) % tp_num_threads];
+        uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (RANGE_LO(r) < RANGE_HI(r)) {
+            int lo = RANGE_LO(r);
+            int hi = RANGE_HI(r);
+            int mid = hi - (hi - lo + 1) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &r, RANGE_PACK(lo, mid), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&th->range, RANGE_PACK(mid, hi), __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void threadpool_work(threadpool_thread_t *th) {
+    do {
+        int task;
+        while (threadpool_pop(th, &task)) {
+            tp_fun(tp_env, task, th->index);
+        }
+    } while (threadpool_steal(th));
+}
+
+// this function is the worker thread that does tasks when a batch is run
+static void *threadpool_entry(void *th_in) {
+    threadpool_thread_t *th = th_in;
+    for (;;) {
+        pthread_barrier_wait(&tp_b_start);
+        threadpool_work(th);
+        pthread_barrier_wait(&tp_b_end);
+    }
+    return NULL;
+}
+
+// if num_threads is 0 or less then the number of online cores is used
+void threadpool_init(int num_threads) {
+    if (tp_num_threads > 0) {
+        printf("ERROR: thread pool already initialised\n");
+        return;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_threads <= 0) {
+            num_threads = 1;
+        }
+    }
+
+    tp_num_threads = num_threads;
+    tp_threads = m_new(threadpool_thread_t, num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        tp_threads[i].range = RANGE_PACK(0, 0);
+        tp_threads[i].index = i;
+    }
+
+    // thread 0 is the caller of threadpool_run, the rest are workers
+    if (num_threads > 1) {
+        pthread_barrier_init(&tp_b_start, NULL, num_threads);
+        pthread_barrier_init(&tp_b_end, NULL, num_threads);
+        for (int i = 1; i < num_threads; i++) {
+            pthread_create(&tp_threads[i].pthread, NULL, threadpool_entry, &tp_threads[i]);
+        }
+    }
+
+    printf("using %d thread%s\n", num_threads, num_threads == 1 ? "" : "s");
+}
+
+int threadpool_get_num_threads(void) {
+    if (tp_num_threads == 0) {
+        threadpool_init(0);
+    }
+    return tp_num_threads;
+}
+
+// runs a task of a batch with the queued tasks appended to it
+static void threadpool_joint_task(void *env, int task, int thread) {
+    if (task < tp_run_num_tasks) {
+        tp_run_fun(tp_run_env, task, thread);
+    } else {
+        tp_queued_fun(tp_queued_env, task - tp_run_num_tasks, thread);
+    }
+}
+
+void threadpool_run(int num_tasks, threadpool_task_fun_t fun, void *env) {
+    int num_threads = threadpool_get_num_threads();
+
+    if (num_tasks <= 0) {
+        return;
+    }
+
+    // take on any queued tasks
+    if (tp_queued_num_tasks > 0) {
+        tp_run_num_tasks = num_tasks;
+        tp_run_fun = fun;
+        tp_run_env = env;
+        num_tasks += tp_queued_num_tasks;
+        fun = threadpool_joint_task;
+        env = NULL;
+        tp_queued_num_tasks = 0;
+    }
+
+    if (num_threads == 1 || num_tasks == 1) {
+        // without threading
+        for (int i = 0; i < num_tasks; i++) {
+            fun(env, i, 0);
+        }
+        return;
+    }
+
+    // give each thread an equal, contiguous share of the tasks
+    tp_fun = fun;
+    tp_env = env;
+    for (int i = 0; i < num_threads; i++) {
+        tp_threads[i].range = RANGE_PACK((int64_t)num_tasks * i / num_threads, (int64_t)num_tasks * (i + 1) / num_threads);
+    }
+
+    // start worker threads, do our own work, then wait for all threads to finish
+    pthread_barrier_wait(&tp_b_start);
+    threadpool_work(&tp_threads[0]);
+    pthread_barrier_wait(&tp_b_end);
+}
+
+void threadpool_queue(int num_tasks, threadpool_task_fun_t fun, void *env) {
+    // only one batch can be queued at a time
+    threadpool_run_queued();
+    tp_queued_num_tasks = num_tasks;
+    tp_queued_fun = fun;
+    tp_queued_env = env;
+}
+
+void threadpool_run_queued(void) {
+    if (tp_queued_num_tasks > 0) {
+        int num_tasks = tp_queued_num_tasks;
+        tp_queued_num_tasks = 0;
+        threadpool_run(num_tasks, tp_queued_fun, tp_queued_env);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef _INCLUDED_THREADPOOL_H
+#define _INCLUDED_THREADPOOL_H
+
+// a pool of persistent worker threads for running a batch of independent tasks
+// each thread starts with a contiguous range of tasks and, when it runs out,
+// steals half of the remaining range of another thread
+
+// called for each task; thread is the index of the thread running the task, in [0, num_threads)
+typedef void (*threadpool_task_fun_t)(void *env, int task, int thread);
+
+void threadpool_init(int num_threads);
+int threadpool_get_num_threads(void);
+
+// runs fun for each task in [0, num_tasks) and blocks until all tasks are done
+// must not be called from within a task
+void threadpool_run(int num_tasks, threadpool_task_fun_t fun, void *env);
+
+// queues tasks that are independent of whatever runs next, to be run together
+// with the tasks of the next call to threadpool_run, so that they fill the
+// threads that would otherwise wait at the end of that batch; env must stay
+// valid until they are done, which threadpool_run_queued makes sure of
+void threadpool_queue(int num_tasks, threadpool_task_fun_t fun, void *env);
+void threadpool_run_queued(void);
+
+#endif // _INCLUDED_THREADPOOL_H